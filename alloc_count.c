@@ -0,0 +1,71 @@
+/**
+ * alloc_count.c
+ *
+ * Replaces the allocator entry points for the whole process. A definition in
+ * the executable takes precedence over libc's for every shared library too,
+ * so allocations made by libc (opendir, stdio) and libfuse are counted as
+ * well as our own. The real work is done by glibc's __libc_* functions.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "alloc_count.h"
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+static uint64_t allocations;
+static __thread uint64_t thread_allocations;
+
+static inline void count_allocation(void){
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    thread_allocations++;
+}
+
+uint64_t heap_allocations(void){
+    return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+
+uint64_t thread_heap_allocations(void){
+    return thread_allocations;
+}
+
+void *malloc(size_t size){
+    count_allocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size){
+    count_allocation();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size){
+    count_allocation();
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size){
+    count_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size){
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size){
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0){
+        return EINVAL;
+    }
+    void *mem = memalign(alignment, size);
+    if (mem == NULL){
+        return ENOMEM;
+    }
+    *ptr = mem;
+    return 0;
+}
@@ -0,0 +1,28 @@
+/**
+ * alloc_count.h
+ *
+ * Counts every heap allocation made by the process, including the ones made
+ * inside libc and libfuse, so the stats can show whether a request path allocates.
+ */
+
+#ifndef _ALLOC_COUNT_H_
+#define _ALLOC_COUNT_H_
+
+#include <stdint.h>
+
+/**
+ * heap allocation count
+ *
+ * returns how many malloc, calloc, realloc and aligned allocations the process has made
+ */
+uint64_t heap_allocations(void);
+
+/**
+ * thread heap allocation count
+ *
+ * returns how many of those the calling thread made, so a caller can take the
+ * difference around a piece of code to see what it allocated itself
+ */
+uint64_t thread_heap_allocations(void);
+
+#endif
@@ -7,6 +7,225 @@
 #ifndef _COMMON_H_
 #define _COMMON_H_
 
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+
 #define DEFAULT_PORT 5555
+#define MAX_REQ 1024
+/* directory entries the client asks for per readdir round trip */
+#define READDIR_BATCH 128
+/* most directory entries the server sends in one reply */
+#define READDIR_MAX_BATCH 1024
+
+/**
+ * request types the client can send to the server
+ */
+enum request_types {
+    REQ_READDIR = 1,
+    REQ_GETATTR = 2,
+    REQ_OPEN = 3,
+    REQ_READ = 4,
+};
+
+/**
+ *this is the message struct sent through the server-client connection
+ * it has request type and the request specification. The path is carried
+ * inline since a pointer means nothing on the other side of the socket.
+ * For reads size/offset are the read range, for readdir size is the batch
+ * size and offset is the cookie of the entry to resume after (0 to start).
+ */
+struct __attribute__((__packed__)) request_operations {
+    int32_t request_type;
+    uint64_t size;
+    int64_t offset;
+    char request[MAX_REQ];
+};
+
+/**
+ * reply header sent by the server before any payload
+ * status is 0 on success or a negative errno, length is the payload size
+ */
+struct __attribute__((__packed__)) reply_header {
+    int32_t status;
+    uint64_t length;
+};
+
+/* size of one readdir entry on the wire: length, cookie, name */
+#define READDIR_ENTRY_MAX (sizeof(int32_t) + sizeof(int64_t) + NAME_MAX)
+/* largest reply the server builds in memory: a full readdir batch plus its trailer */
+#define REPLY_FRAME_MAX (sizeof(struct reply_header) \
+        + READDIR_MAX_BATCH * READDIR_ENTRY_MAX + 2 * sizeof(int32_t))
+/* how much of a reply the client buffers per recv */
+#define READ_FRAME_SIZE (64 * 1024)
+
+/**
+ * buffered reply reader, one lives per client thread and is reused for every request
+ */
+struct frame_reader {
+    int socket_fd;
+    size_t start;
+    size_t end;
+    char data[READ_FRAME_SIZE];
+};
+
+/* "NFST", first bytes of a trace file written by netfs_client --trace */
+#define TRACE_MAGIC 0x5453464e
+#define TRACE_VERSION 1
+
+struct __attribute__((__packed__)) trace_file_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+/**
+ * one fuse operation in a trace, followed by path_len bytes of path (not NUL
+ * terminated) in the form sent to the server. start_ns is relative to when
+ * tracing started, status is what fuse was given. size and offset are the read
+ * range; for readdir size is how many entries fuse was offered and offset where
+ * the listing resumed, for open size holds the open flags.
+ */
+struct __attribute__((__packed__)) trace_record {
+    uint64_t start_ns;
+    uint64_t latency_ns;
+    int32_t status;
+    uint8_t request_type;
+    uint64_t size;
+    int64_t offset;
+    uint16_t path_len;
+};
+
+/**
+ * timespec to nanoseconds
+ *
+ * @param time | the time to convert
+ *
+ * Does not envoke helper functions
+ */
+static inline uint64_t timespec_ns(const struct timespec *time) {
+    return (uint64_t) time->tv_sec * 1000000000ull + time->tv_nsec;
+}
+
+/**
+ * send all method
+ *
+ * keeps sending until the whole buffer has been written or the socket fails
+ *
+ * @param socket_fd | the socket we are writing to
+ *
+ * @param buf | the data to send
+ *
+ * @param len | how many bytes to send
+ *
+ * Does not envoke helper functions
+ */
+static inline int send_all(int socket_fd, const void *buf, size_t len) {
+    const char *pos = buf;
+    while (len > 0) {
+        ssize_t sent = send(socket_fd, pos, len, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        pos += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * recieve all method
+ *
+ * keeps recieving until the whole buffer has been filled, fails on a short read
+ *
+ * @param socket_fd | the socket we are reading from
+ *
+ * @param buf | where the data goes
+ *
+ * @param len | how many bytes we expect
+ *
+ * Does not envoke helper functions
+ */
+static inline int recv_all(int socket_fd, void *buf, size_t len) {
+    char *pos = buf;
+    while (len > 0) {
+        ssize_t got = recv(socket_fd, pos, len, 0);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        pos += got;
+        len -= got;
+    }
+    return 0;
+}
+
+/**
+ * reader reset method
+ *
+ * points a reader at a new connection and drops anything left from the last one
+ *
+ * @param reader | the thread's reader
+ *
+ * @param socket_fd | the connection we are about to read a reply from
+ *
+ * Does not envoke helper functions
+ */
+static inline void reader_reset(struct frame_reader *reader, int socket_fd) {
+    reader->socket_fd = socket_fd;
+    reader->start = 0;
+    reader->end = 0;
+}
+
+/**
+ * reader read method
+ *
+ * copies len bytes of the reply into buf, refilling the frame buffer as needed.
+ * Large reads go straight into buf once the buffered part is used up.
+ *
+ * @param reader | the thread's reader
+ *
+ * @param buf | where the data goes
+ *
+ * @param len | how many bytes we expect
+ *
+ * Envokes helper functions: recv_all
+ */
+static inline int reader_read(struct frame_reader *reader, void *buf, size_t len) {
+    char *pos = buf;
+    while (len > 0) {
+        size_t buffered = reader->end - reader->start;
+        if (buffered > 0) {
+            size_t take = buffered < len ? buffered : len;
+            memcpy(pos, reader->data + reader->start, take);
+            reader->start += take;
+            pos += take;
+            len -= take;
+            continue;
+        }
+        if (len >= READ_FRAME_SIZE) {
+            return recv_all(reader->socket_fd, pos, len);
+        }
+        ssize_t got = recv(reader->socket_fd, reader->data, READ_FRAME_SIZE, 0);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        reader->start = 0;
+        reader->end = got;
+    }
+    return 0;
+}
 
 #endif
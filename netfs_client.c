@@ -6,15 +6,21 @@
  */
 
 #define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
 
 #include <arpa/inet.h>
 #include <sys/sendfile.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <fuse3/fuse.h>
+#include <limits.h>
 #include <netdb.h> 
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -22,13 +28,30 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "alloc_count.h"
 #include "common.h"
 #include "logging.h"
 
 #define TEST_DATA "hello world!\n"
 
+#define MAX_SERVERS 16
+/* points each server gets on the consistent hashing ring */
+#define SHARD_VNODES 64
+/* recent read latencies the hedging deadline is worked out from */
+#define LATENCY_SAMPLES 256
+/* hedging deadline used until we have enough samples, and the lowest we allow */
+#define HEDGE_DEFAULT_NS 10000000ull
+#define HEDGE_MIN_NS 200000ull
+/* largest read we ask the kernel for, also passed as -o max_read */
+#define NETFS_MAX_READ (1024 * 1024)
+/* readahead we allow, the kernel only lowers its own bdi setting to this */
+#define NETFS_MAX_READAHEAD (1024 * 1024)
+/* files whose size and mtime we remember from their last open */
+#define OPEN_CACHE_SIZE 4096
+
 /**
  *Command line options 
  */
@@ -36,6 +59,9 @@ static struct options {
     int show_help;
     int port;
     char* server;
+    char* trace;
+    char* mode;
+    char* streaming;
 } options;
 
 #define OPTION(t, p) { t, offsetof(struct options, p), 1 }
@@ -49,56 +75,320 @@ static const struct fuse_opt option_spec[] = {
     OPTION("--server=%s", server),
     OPTION("--help", show_help),
     OPTION("--port=%d", port),
+    OPTION("--trace=%s", trace),
+    OPTION("--mode=%s", mode),
+    OPTION("--streaming=%s", streaming),
     FUSE_OPT_END 
 };
 
 /**
- *this is the message struct sent through the server-client connection
- * it has request type and the request specification
+ * request and reply buffers, one set per fuse thread and reused for every request
  */
-struct request_operations{
-    int request_type;
-    const char* request;
-}request_op;
+static __thread struct request_operations request_frame;
+static __thread struct frame_reader reply_reader;
 
+/**
+ * the server addresses, resolved once at startup. In shard mode every top level
+ * entry lives on one server, picked on the ring. Otherwise the servers are
+ * replicas of each other.
+ */
+static struct sockaddr_in servers[MAX_SERVERS];
+static int server_count;
+static bool shard_mode;
+static uint32_t ring_points[MAX_SERVERS * SHARD_VNODES];
+static uint8_t ring_servers[MAX_SERVERS * SHARD_VNODES];
+static int ring_size;
+static unsigned replica_cursor;
 
 /**
- * open connection method
+ * recent read latencies (time to the reply header) and the p95 deadline
+ * after which a read is also sent to a second replica
+ */
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t read_latencies[LATENCY_SAMPLES];
+static unsigned latency_count;
+static uint64_t hedge_deadline_ns = HEDGE_DEFAULT_NS;
+static uint64_t hedges_sent;
+static uint64_t hedges_won;
+
+/**
+ * what each file looked like when it was last opened. If it still looks the
+ * same the kernel may keep its cached pages. Slots are picked by path hash and
+ * simply overwritten on collision, the worst case is a dropped cache.
+ */
+struct open_cache_entry {
+    uint32_t path_hash;
+    uint32_t path_len;
+    struct timespec mtime;
+    off_t size;
+};
+static struct open_cache_entry open_cache[OPEN_CACHE_SIZE];
+static pthread_mutex_t open_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t cache_keeps;
+
+/**
+ * requests sent so far, by request type
+ */
+static uint64_t request_counts[REQ_READ + 1];
+/* allocations made inside our fuse operations, libfuse's own per request work excluded */
+static uint64_t operation_allocations;
+
+/**
+ * operation trace, only recorded when --trace is given
+ */
+static FILE *trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec trace_epoch;
+/* the server that took this thread's last unhedged request */
+static __thread int request_server;
+
+
+/**
+ * resolve server method
  *
- * this function is responsible for setting up the connection on the client side
+ * looks up the server once so no request has to go through the resolver
  *
  * @param server | this tells us the server name we are trying to open
  *
  * @param port | this tells us the port our socket lies in
  *
+ * @param addr | filled with the address to connect to
+ *
  * Does not envoke helper functions
 */
-static int connect_open(char *server, int port){
-    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_fd == -1) {
-        perror("socket");
-        return 1;
-    }
+static int resolve_server(const char *server, int port, struct sockaddr_in *addr){
     struct hostent *server_host = gethostbyname(server);
     if (server_host == NULL) {
         fprintf(stderr, "Could not resolve host: %s\n", server);
-        return 1;
+        return -1;
     }
 
-    struct sockaddr_in serv_addr = { 0 };
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-    serv_addr.sin_addr = *((struct in_addr *) server_host->h_addr);
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    addr->sin_addr = *((struct in_addr *) server_host->h_addr);
+    return 0;
+}
+
+
+/**
+ * hash function
+ *
+ * 32 bit FNV-1a over len bytes
+ *
+ * @param data | what to hash
+ *
+ * @param len | how many bytes
+ *
+ * Does not envoke helper functions
+*/
+static uint32_t fnv_hash(const char *data, size_t len){
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++){
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/**
+ * resolve servers method
+ *
+ * parses a comma separated list of host[:port] and resolves every entry, then
+ * builds the hashing ring. Ring points come from the address so they do not
+ * move when servers are listed in another order.
+ *
+ * @param list | the --server argument
+ *
+ * @param default_port | the port for entries that do not give one
+ *
+ * Envokes helper functions: resolve_server, fnv_hash
+*/
+static int resolve_servers(const char *list, int default_port){
+    char entries[MAX_REQ];
+    char *save;
+
+    if (snprintf(entries, sizeof(entries), "%s", list) >= sizeof(entries)){
+        fprintf(stderr, "server list is too long\n");
+        return -1;
+    }
+
+    for (char *entry = strtok_r(entries, ",", &save); entry != NULL; entry = strtok_r(NULL, ",", &save)){
+        if (server_count == MAX_SERVERS){
+            fprintf(stderr, "at most %d servers are supported\n", MAX_SERVERS);
+            return -1;
+        }
+        int port = default_port;
+        char *colon = strchr(entry, ':');
+        if (colon != NULL){
+            *colon = '\0';
+            port = atoi(colon + 1);
+        }
+        if (resolve_server(entry, port, &servers[server_count]) == -1){
+            return -1;
+        }
+        server_count++;
+    }
+    if (server_count == 0){
+        fprintf(stderr, "no server given\n");
+        return -1;
+    }
+
+    //insertion sort keeps the ring ordered by point
+    for (int i = 0; i < server_count; i++){
+        for (int vnode = 0; vnode < SHARD_VNODES; vnode++){
+            char key[64];
+            int len = snprintf(key, sizeof(key), "%s:%d#%d", inet_ntoa(servers[i].sin_addr),
+                    ntohs(servers[i].sin_port), vnode);
+            uint32_t point = fnv_hash(key, len);
+            int pos = ring_size++;
+            while (pos > 0 && ring_points[pos - 1] > point){
+                ring_points[pos] = ring_points[pos - 1];
+                ring_servers[pos] = ring_servers[pos - 1];
+                pos--;
+            }
+            ring_points[pos] = point;
+            ring_servers[pos] = i;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * shard lookup method
+ *
+ * finds the server that owns a top level name: the first ring point at or
+ * after the name's hash, wrapping around
+ *
+ * @param name | the top level entry, without slashes
+ *
+ * @param len | length of name
+ *
+ * Envokes helper functions: fnv_hash
+*/
+static int shard_for(const char *name, size_t len){
+    uint32_t hash = fnv_hash(name, len);
+    int low = 0;
+    int high = ring_size;
+    while (low < high){
+        int mid = (low + high) / 2;
+        if (ring_points[mid] < hash){
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return ring_servers[low == ring_size ? 0 : low];
+}
+
+
+/**
+ * pick server method
+ *
+ * in shard mode the owner of the path's top level component, otherwise the
+ * next replica in round robin order so load spreads over all of them
+ *
+ * @param path | the fuse path of the request
+ *
+ * Envokes helper functions: shard_for
+*/
+static int pick_server(const char *path){
+    if (shard_mode){
+        const char *name = path + 1;
+        const char *slash = strchr(name, '/');
+        size_t len = slash == NULL ? strlen(name) : (size_t) (slash - name);
+        return len == 0 ? 0 : shard_for(name, len);
+    }
+    return __atomic_fetch_add(&replica_cursor, 1, __ATOMIC_RELAXED) % server_count;
+}
+
+
+/**
+ * home replica method
+ *
+ * the replica that answers a path whenever the answer has to come from the
+ * same server each time, like readdir cookies or the size and mtime that
+ * netfs_open compares with the last open and the kernel checks on getattr
+ *
+ * @param path | the fuse path of the request
+ *
+ * returns the replica, or -1 in shard mode where pick_server already sends a
+ * path to one server
+ *
+ * Envokes helper functions: fnv_hash
+*/
+static int home_replica(const char *path){
+    if (shard_mode){
+        return -1;
+    }
+    return fnv_hash(path, strlen(path)) % server_count;
+}
+
+
+/**
+ * record latency method
+ *
+ * adds a read latency sample and every 32 samples recomputes the p95 deadline
+ * used for hedging. Sorting is done by hand on the stack so it never allocates.
+ *
+ * @param latency_ns | time from sending the read to getting the reply header
+ *
+ * Does not envoke helper functions
+*/
+static void record_read_latency(uint64_t latency_ns){
+    pthread_mutex_lock(&latency_lock);
+    read_latencies[latency_count % LATENCY_SAMPLES] = latency_ns;
+    latency_count++;
+
+    if (latency_count % 32 == 0){
+        uint64_t sorted[LATENCY_SAMPLES];
+        int count = latency_count < LATENCY_SAMPLES ? latency_count : LATENCY_SAMPLES;
+        for (int i = 0; i < count; i++){
+            uint64_t sample = read_latencies[i];
+            int pos = i;
+            while (pos > 0 && sorted[pos - 1] > sample){
+                sorted[pos] = sorted[pos - 1];
+                pos--;
+            }
+            sorted[pos] = sample;
+        }
+        uint64_t deadline = sorted[(count * 95) / 100];
+        hedge_deadline_ns = deadline < HEDGE_MIN_NS ? HEDGE_MIN_NS : deadline;
+    }
+    pthread_mutex_unlock(&latency_lock);
+}
+
+
+/**
+ * open connection method
+ *
+ * this function is responsible for setting up the connection on the client side
+ *
+ * @param addr | the resolved address of the server we are connecting to
+ *
+ * Does not envoke helper functions
+*/
+static int connect_open(const struct sockaddr_in *addr){
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd == -1) {
+        perror("socket");
+        return -1;
+    }
 
     if (connect(
                 socket_fd,
-                (struct sockaddr *) &serv_addr,
+                (struct sockaddr *) addr,
                 sizeof(struct sockaddr_in)) == -1) {
 
         perror("connect");
-        return 1;
+        close(socket_fd);
+        return -1;
     }
-    LOG("Connected to server %s:%d\n", server, port);
+    char host[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr->sin_addr, host, sizeof(host));
+    LOG("Connected to server %s:%d\n", host, ntohs(addr->sin_port));
     return socket_fd;
 }
 
@@ -113,12 +403,231 @@ static int connect_open(char *server, int port){
  * Does not envoke helper functions
 */
 static int connect_close(int connected_server){
-    shutdown(connected_server, 0);
+    shutdown(connected_server, SHUT_RDWR);
     close(connected_server);
     return 0;
 }
 
 
+/**
+ * start request method
+ *
+ * connects to one server and sends it the thread's request frame
+ *
+ * @param server | index of the server to use
+ *
+ * returns the connected socket or -1
+ *
+ * Envokes helper functions: connect_open, connect_close
+*/
+static int start_request(int server){
+    int connection_return=connect_open(&servers[server]);
+    if (connection_return == -1){
+        return -1;
+    }
+    if (send_all(connection_return,&request_frame,sizeof(struct request_operations)) == -1){
+        perror("sending request failed");
+        connect_close(connection_return);
+        return -1;
+    }
+    return connection_return;
+}
+
+
+/**
+ * reply state method
+ *
+ * tells a connection whose reply has started apart from one that only woke
+ * poll because the server hung up or reset it
+ *
+ * @param fd | the polled connection
+ *
+ * returns 1 if reply bytes are waiting, 0 if nothing has happened yet and -1
+ * if the connection is dead
+ *
+ * Does not envoke helper functions
+*/
+static int reply_state(const struct pollfd *fd){
+    if (fd->fd == -1 || (fd->revents & (POLLERR | POLLHUP | POLLNVAL))){
+        return -1;
+    }
+    if (!(fd->revents & POLLIN)){
+        return 0;
+    }
+    //a server that read the request and then died shows up as a readable EOF
+    char byte;
+    ssize_t peeked;
+    while ((peeked = recv(fd->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT)) == -1 && errno == EINTR);
+    if (peeked > 0){
+        return 1;
+    }
+    return peeked == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+}
+
+
+/**
+ * hedged request method
+ *
+ * sends the request to one replica and, if no reply has started by the p95
+ * deadline, sends it to the next replica too. Whichever answers first is kept
+ * and the other connection is dropped. A replica that hangs up before
+ * answering is dropped straight away and the request moves to the other one.
+ *
+ * @param server | the replica to try first
+ *
+ * @param sent_at | moved to when the hedge went out if the hedge wins, so the
+ * latency sample is the winner's own and the deadline does not feed on itself
+ *
+ * returns the connected socket or -1
+ *
+ * Envokes helper functions: start_request, reply_state, connect_close
+*/
+static int hedged_request(int server, struct timespec *sent_at){
+    int first = start_request(server);
+    if (first == -1){
+        return -1;
+    }
+
+    pthread_mutex_lock(&latency_lock);
+    uint64_t deadline = hedge_deadline_ns;
+    pthread_mutex_unlock(&latency_lock);
+
+    struct pollfd fds[2] = { { first, POLLIN, 0 }, { -1, POLLIN, 0 } };
+    struct timespec timeout = { deadline / 1000000000ull, deadline % 1000000000ull };
+    int state = 0;
+    if (ppoll(fds, 1, &timeout, NULL) > 0){
+        state = reply_state(&fds[0]);
+    }
+    if (state == 1){
+        return first;
+    }
+    if (state == -1){
+        connect_close(first);
+        fds[0].fd = -1;
+    }
+
+    struct timespec hedged_at;
+    clock_gettime(CLOCK_MONOTONIC, &hedged_at);
+    int second = start_request((server + 1) % server_count);
+    if (second == -1){
+        //nothing else to race, a live first connection is still our best bet
+        return fds[0].fd;
+    }
+    fds[1].fd = second;
+    if (fds[0].fd == -1){
+        //a plain retry rather than a hedge, time it from when it went out
+        *sent_at = hedged_at;
+        return second;
+    }
+    __atomic_fetch_add(&hedges_sent, 1, __ATOMIC_RELAXED);
+
+    while (fds[0].fd != -1 || fds[1].fd != -1){
+        if (poll(fds, 2, -1) == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < 2; i++){
+            state = fds[i].fd == -1 ? 0 : reply_state(&fds[i]);
+            if (state == 1){
+                if (i == 1){
+                    __atomic_fetch_add(&hedges_won, 1, __ATOMIC_RELAXED);
+                    *sent_at = hedged_at;
+                }
+                if (fds[1 - i].fd != -1){
+                    connect_close(fds[1 - i].fd);
+                }
+                return fds[i].fd;
+            }
+            if (state == -1){
+                connect_close(fds[i].fd);
+                fds[i].fd = -1;
+            }
+        }
+    }
+    for (int i = 0; i < 2; i++){
+        if (fds[i].fd != -1){
+            connect_close(fds[i].fd);
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * send request method
+ *
+ * fills in the request, sends it to a server and reads the reply header.
+ * The fuse path is sent relative to the served directory ("/a" becomes "./a").
+ * The rest of the reply is read through reply_reader. With replicas and
+ * failover a server that cannot be reached is skipped and reads are hedged.
+ *
+ * @param request_type | which operation we want the server to run
+ *
+ * @param path | the fuse path the request is about
+ *
+ * @param size | the read size, 0 for other requests
+ *
+ * @param offset | the read offset, 0 for other requests
+ *
+ * @param reply | filled with the reply header from the server
+ *
+ * @param server | the server to send to, or -1 to let pick_server decide
+ *
+ * @param failover | with replicas, whether the request may move on to the next
+ * replica when the chosen one cannot be reached
+ *
+ * returns the connected socket, or a negative errno if the request could not be sent
+ *
+ * Envokes helper functions: pick_server, start_request, hedged_request, record_read_latency, connect_close
+*/
+static int send_request(int request_type, const char *path, size_t size, off_t offset,
+        struct reply_header *reply, int server, bool failover){
+    struct timespec sent_at;
+    clock_gettime(CLOCK_MONOTONIC, &sent_at);
+
+    request_frame.request_type=request_type;
+    request_frame.size=size;
+    request_frame.offset=offset;
+    if (strcmp(path, "/") == 0){
+        strcpy(request_frame.request, ".");
+    } else if (snprintf(request_frame.request, MAX_REQ, ".%s", path) >= MAX_REQ){
+        return -ENAMETOOLONG;
+    }
+
+    bool replicas = !shard_mode && failover && server_count > 1;
+    bool hedge = replicas && request_type == REQ_READ;
+    if (server == -1){
+        server = pick_server(path);
+    }
+
+    int connection_return = -1;
+    for (int attempt = 0; connection_return == -1 && attempt < (replicas ? server_count : 1); attempt++){
+        request_server = (server + attempt) % server_count;
+        connection_return = hedge ? hedged_request(request_server, &sent_at) : start_request(request_server);
+    }
+    if (connection_return == -1){
+        return -EIO;
+    }
+    __atomic_fetch_add(&request_counts[request_type], 1, __ATOMIC_RELAXED);
+
+    reader_reset(&reply_reader, connection_return);
+    if (reader_read(&reply_reader,reply,sizeof(struct reply_header)) == -1){
+        perror("unable to recieve reply");
+        connect_close(connection_return);
+        return -EIO;
+    }
+
+    if (hedge){
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        record_read_latency(timespec_ns(&now) - timespec_ns(&sent_at));
+    }
+    return connection_return;
+}
+
+
 /**
  * get attributes function
  *
@@ -130,36 +639,74 @@ static int connect_close(int connected_server){
  *
  * @param fi | this is the file information provided by fuse
  *
- * Does not envoke helper functions
+ * Envokes helper functions: send_request, connect_close, home_replica
 */
 static int netfs_getattr(
         const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
 
     LOG("getattr: %s\n", path);
 
-    int connection_return=connect_open(options.server, options.port);
-    if ( connection_return== 1){
-        perror("connect");
-        return 1;
+    struct reply_header reply;
+    //the kernel drops cached pages when size or mtime change, so ask the same
+    //replica netfs_open does instead of whichever is next in round robin
+    int connection_return=send_request(REQ_GETATTR, path, 0, 0, &reply, home_replica(path), true);
+    if (connection_return < 0){
+        return connection_return;
     }
-    request_op.request_type=2;
-    request_op.request=path;
 
-    size_t write_size = send(connection_return,&request_op,sizeof(struct request_operations),0);   
-    if (write_size == -1){
-        perror("sending request failed");
-        return 1;
+    int result = reply.status;
+    if (result == 0 && reader_read(&reply_reader,stbuf,sizeof(struct stat)) == -1){
+        perror("unable to recieve file attributes");
+        result = -EIO;
     }
-    size_t rec_size;
-    rec_size=recv(connection_return,&stbuf,sizeof(struct stat),0);
 
-    if (rec_size == -1){
-        perror("unable to recieve open connection");
-        return -1;
-    }
-    
     connect_close(connection_return);
 
+    return result;
+}
+
+
+/**
+ * open directory function
+ *
+ * with replicas, gives the open directory a slot remembering which replica
+ * serves its listing, since the cookies it hands out only work there
+ *
+ * @param path | the directory being opened
+ *
+ * @param fi | fuse file information, fh gets the slot
+ *
+ * Does not envoke helper functions
+*/
+static int netfs_opendir(const char *path, struct fuse_file_info *fi) {
+    fi->fh = 0;
+    if (shard_mode || server_count < 2){
+        return 0;
+    }
+
+    int *listing = malloc(sizeof(int));
+    if (listing == NULL){
+        return -ENOMEM;
+    }
+    *listing = -1;
+    fi->fh = (uintptr_t) listing;
+    return 0;
+}
+
+
+/**
+ * release directory function
+ *
+ * frees the slot netfs_opendir gave the directory
+ *
+ * @param path | the directory being closed
+ *
+ * @param fi | fuse file information
+ *
+ * Does not envoke helper functions
+*/
+static int netfs_releasedir(const char *path, struct fuse_file_info *fi) {
+    free((void *) (uintptr_t) fi->fh);
     return 0;
 }
 
@@ -168,6 +715,9 @@ static int netfs_getattr(
  * read directory function
  *
  * this function is responsible for opening a directory and reading its contents
+ * entries are fetched from the server in batches and handed to fuse with the cookie
+ * that resumes after them, so a huge directory never has to be held in memory and
+ * the next call picks up where the kernel buffer filled instead of starting over
  *
  * @param path | this is the path that we are trying to read into the directory 
  *
@@ -175,105 +725,227 @@ static int netfs_getattr(
  *
  * @param filler | this fills our mounted file system
  *
- * @param offset | position in file
+ * @param offset | the cookie of the last entry the kernel already has, 0 to start.
+ * For the root in shard mode it is the position in the merged listing instead
  *
- * @param fi | fuse file information
+ * @param fi | fuse file information, with replicas fh is the slot from netfs_opendir
  *
  * @param flags | if any flags are provided
  *
- * Does not envoke helper functions
+ * Envokes helper functions: send_request, connect_close, home_replica, shard_for
 */
 static int netfs_readdir(
         const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
         struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
 
-    LOG("readdir: %s\n", path);
-    int connection_return=connect_open(options.server, options.port);
-    if ( connection_return== 1){
-        perror("unable to establish connection");
-        return 1;
-    }
-    request_op.request_type=1;
-    request_op.request=path;
-    
-    size_t write_size = send(connection_return,&request_op,sizeof(struct request_operations),0);   
-    if (write_size == -1){
-        perror("sending request failed");
-        return 1;
+    LOG("readdir: %s offset %ld\n", path, (long) offset);
+
+    int32_t size;
+    char rec_buff[NAME_MAX + 1];
+
+    //cookies only mean something to the server that made them. A listing starts on
+    //the path's home replica and may fail over until it has handed out cookies, after
+    //that it stays on the replica that answered for as long as the directory is open.
+    //The shard root is merged with positional offsets
+    bool merged = shard_mode && strcmp(path, "/") == 0;
+    int *listing = fi != NULL ? (int *) (uintptr_t) fi->fh : NULL;
+    int first_server = merged ? 0 : home_replica(path);
+    bool failover = !shard_mode && offset == 0;
+    if (listing != NULL && offset != 0 && *listing != -1){
+        first_server = *listing;
     }
+    int last_server = merged ? server_count - 1 : first_server;
+    int64_t position = 0;
 
-    size_t recieve_size_buff;
-    size_t recieve_size_length;
-    char *rec_buff;
-    int size;
+    for (int server = first_server; server <= last_server; server++){
+        int64_t cookie = merged ? 0 : offset;
+        int32_t at_end = 0;
+        int target = server;
 
+        while (!at_end){
+            struct reply_header reply;
+            int connection_return=send_request(REQ_READDIR, path, READDIR_BATCH, cookie, &reply, target, failover);
+            if (connection_return < 0){
+                return connection_return;
+            }
+            if (!shard_mode){
+                target = request_server;
+                failover = false;
+                if (listing != NULL){
+                    *listing = request_server;
+                }
+            }
+            if (reply.status != 0){
+                connect_close(connection_return);
+                return reply.status;
+            }
 
-    filler(buf, ".", NULL, 0, 0);
-    filler(buf, "..", NULL, 0, 0);
+            while (true){
+                if (reader_read(&reply_reader,&size,sizeof(int32_t)) == -1 || size < 0 || size > NAME_MAX){
+                    perror("error recieving file name");
+                    connect_close(connection_return);
+                    return -EIO;
+                }
+                if (size == 0){
+                    break;
+                }
 
-    while (true){
-        recieve_size_length =recv(connection_return,&size,sizeof(int),0);
-        rec_buff= (char *)malloc(size);
-        recieve_size_buff=recv(connection_return,&rec_buff,size,0);
-        filler(buf, rec_buff, NULL, 0, 0);
+                int64_t next_cookie;
+                if (reader_read(&reply_reader,&next_cookie,sizeof(int64_t)) == -1
+                        || reader_read(&reply_reader,rec_buff,size) == -1){
+                    perror("error recieving file name");
+                    connect_close(connection_return);
+                    return -EIO;
+                }
+                rec_buff[size] = '\0';
+                cookie = next_cookie;
 
-        if (recieve_size_length == -1 || recieve_size_buff== -1){
-            perror("error recieving file name");
-            return 1;
-        }
+                int64_t entry_offset = next_cookie;
+                if (merged){
+                    //each shard only lists what it owns, "." and ".." come from the first one
+                    bool dots = strcmp(rec_buff, ".") == 0 || strcmp(rec_buff, "..") == 0;
+                    if (dots ? server != 0 : shard_for(rec_buff, size) != server){
+                        continue;
+                    }
+                    entry_offset = ++position;
+                    if (entry_offset <= offset){
+                        continue;
+                    }
+                }
 
-        if (rec_buff == NULL){
-            break;
-        }
+                //the kernel buffer is full, it will call again with the last offset it took
+                if (filler(buf, rec_buff, NULL, entry_offset, 0) != 0){
+                    connect_close(connection_return);
+                    return 0;
+                }
+            }
 
+            if (reader_read(&reply_reader,&at_end,sizeof(int32_t)) == -1){
+                perror("error recieving end of directory");
+                connect_close(connection_return);
+                return -EIO;
+            }
+            connect_close(connection_return);
+        }
     }
-    connect_close(connection_return);
 
     return 0;
     
 }
 
 
+/**
+ * streaming check method
+ *
+ * tells if a path matches one of the colon separated --streaming patterns
+ *
+ * @param path | the fuse path being opened
+ *
+ * Does not envoke helper functions
+*/
+static bool is_streaming(const char *path){
+    const char *pattern = options.streaming;
+    char segment[MAX_REQ];
+
+    while (pattern != NULL && *pattern != '\0'){
+        const char *end = strchr(pattern, ':');
+        size_t len = end == NULL ? strlen(pattern) : (size_t) (end - pattern);
+        if (len > 0 && len < sizeof(segment)){
+            memcpy(segment, pattern, len);
+            segment[len] = '\0';
+            if (fnmatch(segment, path, 0) == 0){
+                return true;
+            }
+        }
+        pattern = end == NULL ? NULL : end + 1;
+    }
+    return false;
+}
+
+
+/**
+ * open cache check method
+ *
+ * compares a file's size and mtime with what they were on its last open and
+ * remembers the new values
+ *
+ * @param path | the fuse path being opened
+ *
+ * @param status | the attributes the server sent with the open
+ *
+ * returns 1 if the file is unchanged and the kernel may keep its cached pages
+ *
+ * Envokes helper functions: fnv_hash
+*/
+static int open_cache_check(const char *path, const struct stat *status){
+    size_t len = strlen(path);
+    uint32_t hash = fnv_hash(path, len);
+    struct open_cache_entry *entry = &open_cache[hash % OPEN_CACHE_SIZE];
+
+    pthread_mutex_lock(&open_cache_lock);
+    int keep = entry->path_hash == hash && entry->path_len == len
+        && entry->size == status->st_size
+        && entry->mtime.tv_sec == status->st_mtim.tv_sec
+        && entry->mtime.tv_nsec == status->st_mtim.tv_nsec;
+    entry->path_hash = hash;
+    entry->path_len = len;
+    entry->size = status->st_size;
+    entry->mtime = status->st_mtim;
+    pthread_mutex_unlock(&open_cache_lock);
+
+    if (keep){
+        __atomic_fetch_add(&cache_keeps, 1, __ATOMIC_RELAXED);
+    }
+    return keep;
+}
+
+
 /**
  * open file function
  *
  * this function is responsible for opening a file
+ * unchanged files keep their kernel page cache, streaming files bypass it
  *
  * @param path | this is the path that we are trying to read into the directory 
  *
  * @param fi | fuse file information
  *
- * Does not envoke helper functions
+ * Envokes helper functions: send_request, connect_close, home_replica, is_streaming, open_cache_check
 */
 static int netfs_open(const char *path, struct fuse_file_info *fi) {
 
     LOG("open: %s\n", path);
 
-    int connection_return=connect_open(options.server, options.port);
-    if ( connection_return== 1){
-        perror("connect");
-        return -1;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY){
+        return -EACCES;
     }
-    request_op.request_type=3;
-    request_op.request=path;
 
-     size_t write_size = send(connection_return,&request_op,sizeof(struct request_operations),0);   
-    if (write_size == -1){
-        perror("sending request failed");
-        return -1;
+    struct reply_header reply;
+    //replicas can differ in mtime, so always compare against the same one
+    int connection_return=send_request(REQ_OPEN, path, 0, 0, &reply, home_replica(path), true);
+    if (connection_return < 0){
+        return connection_return;
     }
-    int succ_output;
-    int rec_size;
 
-    rec_size=recv(connection_return,&succ_output,sizeof(int),0);
-    if (rec_size == -1 || succ_output == -1){
-        perror("unable to retrieve open file request");
-        return -1;
+    struct stat status;
+    int result = reply.status;
+    if (result == 0 && (reply.length != sizeof(struct stat)
+                || reader_read(&reply_reader,&status,sizeof(struct stat)) == -1)){
+        perror("unable to recieve file attributes");
+        result = -EIO;
     }
-    
     connect_close(connection_return);
+    if (result != 0){
+        return result;
+    }
 
-    return succ_output;
+    if (is_streaming(path)){
+        //streamed once and thrown away, do not let it push other files out of the page cache
+        fi->direct_io = 1;
+        return 0;
+    }
+    fi->keep_cache = open_cache_check(path, &status);
+    return 0;
 }
 
 
@@ -292,70 +964,335 @@ static int netfs_open(const char *path, struct fuse_file_info *fi) {
  *
  * @param fi | fuse file information
  *
- * Does not envoke helper functions
+ * Envokes helper functions: send_request, connect_close
 */
 static int netfs_read(
         const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi) {
 
     LOG("read: %s\n", path);
- 
-    int connection_return=connect_open(options.server, options.port);
-    if ( connection_return== 1){
-        perror("unable to establish connection");
-        return -1;
-    }
-    request_op.request_type=4;
-    request_op.request=path;
 
-    //send the type of request we are sending to the server
-    size_t write_size = send(connection_return,&request_op,sizeof(struct request_operations),0);   
-    if (write_size == -1){
-        perror("sending request failed");
-        return -1;
+    //send the request along with the size and offset we want
+    struct reply_header reply;
+    int connection_return=send_request(REQ_READ, path, size, offset, &reply, -1, true);
+    if (connection_return < 0){
+        return connection_return;
+    }
+    if (reply.status != 0 || reply.length > size){
+        connect_close(connection_return);
+        return reply.status != 0 ? reply.status : -EIO;
     }
-    //send the size of read requested
-    write_size = send(connection_return,&size,sizeof(size_t),0);   
-    if (write_size == -1){
-        perror("sending request failed");
-        return -1;
-    } 
-    //send the offset we are starting from
-    write_size = send(connection_return,&offset,sizeof(off_t),0);   
-    if (write_size == -1){
-        perror("sending request failed");
-        return -1;
-    } 
 
-    //recieve the buffer read from offset to the selected size if available
-    size_t rec_size=recv(connection_return,&buf,sizeof(char *),0);
-    if (rec_size == -1){
+    //recieve the buffer read from offset, the server tells us how much it read
+    if (reader_read(&reply_reader,buf,reply.length) == -1){
         perror("unable to retrieve file buffer");
-        return -1;
-    }
-    //recive the size that was read to send it back 
-    rec_size=recv(connection_return,&size,sizeof(int),0);
-    if (rec_size == -1){
-        perror("unable to retrieve size read");
-        return -1;
+        connect_close(connection_return);
+        return -EIO;
     }
     connect_close(connection_return);
 
     //return the size read by the server which we recieved
-    return size;
+    return reply.length;
 }
 
 
 
+/**
+ * where a fuse operation started, taken by start_operation
+ */
+struct operation_start {
+    struct timespec time;
+    uint64_t allocations;
+};
+
+
+/**
+ * start operation method
+ *
+ * notes when a fuse operation started and how many allocations its thread had made
+ *
+ * @param start | filled in for finish_operation
+ *
+ * Envokes helper functions: thread_heap_allocations
+*/
+static void start_operation(struct operation_start *start){
+    clock_gettime(CLOCK_MONOTONIC, &start->time);
+    start->allocations = thread_heap_allocations();
+}
+
+
+/**
+ * finish operation method
+ *
+ * every fuse operation ends here, including ones that never reached a server.
+ * Adds what the operation allocated to operation_allocations and, when tracing,
+ * appends it to the trace file: type, path in the form the server is sent,
+ * size, offset, start time, latency and result.
+ *
+ * @param request_type | the request the operation maps to
+ *
+ * @param path | the fuse path
+ *
+ * @param size | read size, entries handed to fuse for readdir, open flags for open
+ *
+ * @param offset | read offset or readdir offset, 0 otherwise
+ *
+ * @param start | what start_operation noted when fuse called us
+ *
+ * @param status | what we are about to hand back to fuse
+ *
+ * returns status so callers can return straight through it
+ *
+ * Envokes helper functions: thread_heap_allocations
+*/
+static int finish_operation(int request_type, const char *path, uint64_t size, int64_t offset,
+        const struct operation_start *start, int status){
+    __atomic_fetch_add(&operation_allocations,
+            thread_heap_allocations() - start->allocations, __ATOMIC_RELAXED);
+    if (trace_file == NULL){
+        return status;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    //"/" is sent as "." and everything else as "." followed by the path
+    bool root = strcmp(path, "/") == 0;
+    size_t path_len = root ? 0 : strlen(path);
+    if (path_len > UINT16_MAX - 1){
+        path_len = UINT16_MAX - 1;
+    }
+
+    struct trace_record record = { 0 };
+    record.start_ns = timespec_ns(&start->time) - timespec_ns(&trace_epoch);
+    record.latency_ns = timespec_ns(&now) - timespec_ns(&start->time);
+    record.status = status;
+    record.request_type = request_type;
+    record.size = size;
+    record.offset = offset;
+    record.path_len = path_len + 1;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL && (fwrite(&record, sizeof(record), 1, trace_file) != 1
+            || fwrite(".", 1, 1, trace_file) != 1
+            || (path_len > 0 && fwrite(path, path_len, 1, trace_file) != 1))){
+        perror("unable to write trace");
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return status;
+}
+
+
+/**
+ * measured get attributes function
+ *
+ * netfs_getattr between start_operation and finish_operation
+ *
+ * Envokes helper functions: start_operation, netfs_getattr, finish_operation
+*/
+static int measured_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+    struct operation_start start;
+    start_operation(&start);
+    int result = netfs_getattr(path, stbuf, fi);
+    return finish_operation(REQ_GETATTR, path, 0, 0, &start, result);
+}
+
+
+/**
+ * what measured_readdir hands netfs_readdir as its buffer, so entries can be counted
+ */
+struct measured_fill {
+    void *buf;
+    fuse_fill_dir_t filler;
+    uint64_t entries;
+};
+
+
+/**
+ * measured filler function
+ *
+ * counts an entry and passes it on to the real fuse filler
+ *
+ * Does not envoke helper functions
+*/
+static int measured_filler(void *buf, const char *name, const struct stat *stbuf,
+        off_t offset, enum fuse_fill_dir_flags flags) {
+    struct measured_fill *fill = buf;
+    fill->entries++;
+    return fill->filler(fill->buf, name, stbuf, offset, flags);
+}
+
+
+/**
+ * measured read directory function
+ *
+ * netfs_readdir between start_operation and finish_operation, the trace record's
+ * size is how many entries were offered to fuse so a replay can read the same amount
+ *
+ * Envokes helper functions: start_operation, netfs_readdir, measured_filler, finish_operation
+*/
+static int measured_readdir(
+        const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+        struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    struct operation_start start;
+    start_operation(&start);
+    struct measured_fill fill = { buf, filler, 0 };
+    int result = netfs_readdir(path, &fill, measured_filler, offset, fi, flags);
+    return finish_operation(REQ_READDIR, path, fill.entries, offset, &start, result);
+}
+
+
+/**
+ * measured open function
+ *
+ * netfs_open between start_operation and finish_operation, the open flags go in
+ * the trace record's size since a replay needs them to refuse the same opens
+ *
+ * Envokes helper functions: start_operation, netfs_open, finish_operation
+*/
+static int measured_open(const char *path, struct fuse_file_info *fi) {
+    struct operation_start start;
+    start_operation(&start);
+    int result = netfs_open(path, fi);
+    return finish_operation(REQ_OPEN, path, fi->flags, 0, &start, result);
+}
+
+
+/**
+ * measured read function
+ *
+ * netfs_read between start_operation and finish_operation
+ *
+ * Envokes helper functions: start_operation, netfs_read, finish_operation
+*/
+static int measured_read(
+        const char *path, char *buf, size_t size, off_t offset,
+        struct fuse_file_info *fi) {
+    struct operation_start start;
+    start_operation(&start);
+    int result = netfs_read(path, buf, size, offset, fi);
+    return finish_operation(REQ_READ, path, size, offset, &start, result);
+}
+
+
+/**
+ * print stats function
+ *
+ * writes the request counters and how many heap allocations the client has made,
+ * in total and inside our own getattr, readdir, open and read
+ *
+ * @param out | where the stats are written
+ *
+ * Does not envoke helper functions
+*/
+static void print_stats(FILE *out){
+    fprintf(out, "readdir: %lu, getattr: %lu, open: %lu, read: %lu\n"
+            "heap allocations: %lu, in netfs operations: %lu\n"
+            "opens served from page cache: %lu\n"
+            "hedged reads: %lu, hedges won: %lu, hedge deadline: %.3fms\n",
+            __atomic_load_n(&request_counts[REQ_READDIR], __ATOMIC_RELAXED),
+            __atomic_load_n(&request_counts[REQ_GETATTR], __ATOMIC_RELAXED),
+            __atomic_load_n(&request_counts[REQ_OPEN], __ATOMIC_RELAXED),
+            __atomic_load_n(&request_counts[REQ_READ], __ATOMIC_RELAXED),
+            heap_allocations(),
+            __atomic_load_n(&operation_allocations, __ATOMIC_RELAXED),
+            __atomic_load_n(&cache_keeps, __ATOMIC_RELAXED),
+            __atomic_load_n(&hedges_sent, __ATOMIC_RELAXED),
+            __atomic_load_n(&hedges_won, __ATOMIC_RELAXED),
+            __atomic_load_n(&hedge_deadline_ns, __ATOMIC_RELAXED) / 1e6);
+    fflush(out);
+}
+
+
+/**
+ * stats thread
+ *
+ * dumps the stats to stderr and flushes the trace every time the client gets SIGUSR1
+ *
+ * @param arg | unused
+ *
+ * Envokes helper functions: print_stats
+*/
+static void *stats_thread(void *arg){
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    while (true){
+        int sig;
+        if (sigwait(&set, &sig) == 0){
+            print_stats(stderr);
+            if (trace_file != NULL){
+                pthread_mutex_lock(&trace_lock);
+                fflush(trace_file);
+                pthread_mutex_unlock(&trace_lock);
+            }
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * init function
+ *
+ * called by fuse once the file system is mounted (and daemonized), starts the stats thread
+ * and sets up the connection so the kernel does big reads, may read ahead up to the
+ * same size, and moves data with splice where it can. Page cache reuse is decided per
+ * open by netfs_open unless -o kernel_cache or -o auto_cache is given.
+ *
+ * @param conn | fuse connection information
+ *
+ * @param cfg | fuse configuration
+ *
+ * Envokes helper functions: stats_thread
+*/
+static void *netfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    conn->max_read = NETFS_MAX_READ;
+    conn->max_readahead = NETFS_MAX_READAHEAD;
+    conn->max_background = 64;
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stats_thread, NULL) == 0){
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+
+/**
+ * destroy function
+ *
+ * called by fuse on unmount, makes sure the whole trace reaches the disk
+ *
+ * @param private_data | unused
+ *
+ * Does not envoke helper functions
+*/
+static void netfs_destroy(void *private_data) {
+    if (trace_file != NULL){
+        pthread_mutex_lock(&trace_lock);
+        fclose(trace_file);
+        trace_file = NULL;
+        pthread_mutex_unlock(&trace_lock);
+    }
+}
+
+
 /** 
  *This struct maps file system operations to our custom functions defined
  * above. 
  */
 static struct fuse_operations netfs_client_ops = {
-    .getattr = netfs_getattr,
-    .readdir = netfs_readdir,
-    .open = netfs_open,
-    .read = netfs_read,
+    .init = netfs_init,
+    .destroy = netfs_destroy,
+    .getattr = measured_getattr,
+    .opendir = netfs_opendir,
+    .readdir = measured_readdir,
+    .releasedir = netfs_releasedir,
+    .open = measured_open,
+    .read = measured_read,
 };
 
 /** 
@@ -365,8 +1302,19 @@ static struct fuse_operations netfs_client_ops = {
 static void show_help(char *argv[]) {
     printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
     printf("File-system specific options:\n"
+            "    --server=<s>        Server(s) to connect to, as\n"
+            "                        host[:port],host[:port],...\n"
+            "                        (default: localhost)\n"
+            "    --mode=<m>          replica: every server has the same\n"
+            "                        files (default), shard: top level\n"
+            "                        entries are spread over the servers\n"
             "    --port=<n>          Port number to connect to\n"
-            "                        (default: %d)"
+            "                        (default: %d)\n"
+            "    --trace=<file>      Record every request to <file>\n"
+            "                        for netfs_replay\n"
+            "    --streaming=<p>     Colon separated patterns of files\n"
+            "                        read once, these bypass the page\n"
+            "                        cache (e.g. /logs/*:*.mp4)"
             "\n", DEFAULT_PORT);
 }
 
@@ -379,6 +1327,9 @@ static void show_help(char *argv[]) {
 int main(int argc, char *argv[]) {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
+    options.server = strdup("localhost");
+    options.port = DEFAULT_PORT;
+
     /* Parse options */
     if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1) {
         return 1;
@@ -388,7 +1339,38 @@ int main(int argc, char *argv[]) {
         show_help(argv);
         assert(fuse_opt_add_arg(&args, "--help") == 0);
         args.argv[0] = (char*) "";
+    } else if (resolve_servers(options.server, options.port) == -1) {
+        return 1;
     }
 
+    //the kernel only sends reads as big as the mount option allows
+    char max_read[64];
+    snprintf(max_read, sizeof(max_read), "-omax_read=%d", NETFS_MAX_READ);
+    assert(fuse_opt_add_arg(&args, max_read) == 0);
+
+    if (options.mode != NULL && strcmp(options.mode, "shard") == 0) {
+        shard_mode = true;
+    } else if (options.mode != NULL && strcmp(options.mode, "replica") != 0) {
+        fprintf(stderr, "unknown mode: %s\n", options.mode);
+        return 1;
+    }
+
+    //opened before fuse daemonizes, so a relative path still means the current directory
+    if (options.trace != NULL && !options.show_help) {
+        trace_file = fopen(options.trace, "w");
+        struct trace_file_header header = { TRACE_MAGIC, TRACE_VERSION };
+        if (trace_file == NULL || fwrite(&header, sizeof(header), 1, trace_file) != 1) {
+            perror("unable to open trace file");
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+    }
+
+    //the stats thread takes SIGUSR1, every fuse thread inherits this mask
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
     return fuse_main(args.argc, args.argv, &netfs_client_ops, NULL);
 }
@@ -0,0 +1,514 @@
+/**
+ * netfs_replay.c
+ *
+ * Replays an operation trace recorded with netfs_client --trace against a
+ * netfs_server and reports how the replayed latencies compare to the
+ * recorded ones.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "logging.h"
+
+#define DEFAULT_THREADS 16
+
+/**
+ * one traced operation and what happened when we replayed it,
+ * path is left empty when it was too long to ever reach the server
+ */
+struct replay_op {
+    struct trace_record record;
+    char path[MAX_REQ];
+    uint64_t replay_latency_ns;
+    int32_t replay_status;
+};
+
+struct replay_op *ops;
+size_t op_count;
+size_t next_op;
+pthread_mutex_t op_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* 1 replays at the recorded pace, 2 twice as fast, 0 as fast as possible */
+double speed = 1;
+/* print every record after the summary */
+bool verbose;
+struct sockaddr_in server_addr;
+struct timespec replay_epoch;
+
+const char *request_names[REQ_READ + 1] = {
+    [REQ_READDIR] = "readdir",
+    [REQ_GETATTR] = "getattr",
+    [REQ_OPEN] = "open",
+    [REQ_READ] = "read",
+};
+
+
+/**
+ * record order helper for qsort
+ *
+ * Does not envoke helper functions
+ */
+static int compare_start(const void *a, const void *b){
+    const struct replay_op *left = a;
+    const struct replay_op *right = b;
+    if (left->record.start_ns == right->record.start_ns){
+        return 0;
+    }
+    return left->record.start_ns < right->record.start_ns ? -1 : 1;
+}
+
+
+/**
+ * latency order helper for qsort
+ *
+ * Does not envoke helper functions
+ */
+static int compare_latency(const void *a, const void *b){
+    uint64_t left = *(const uint64_t *) a;
+    uint64_t right = *(const uint64_t *) b;
+    if (left == right){
+        return 0;
+    }
+    return left < right ? -1 : 1;
+}
+
+
+/**
+ * load trace function
+ *
+ * reads every record of a trace into ops and sorts them by start time.
+ * The client writes records when operations finish, not when they start.
+ *
+ * @param trace_path | the trace written by netfs_client
+ *
+ * Does not envoke helper functions
+ */
+static int load_trace(const char *trace_path){
+    FILE *trace = fopen(trace_path, "r");
+    if (trace == NULL){
+        perror("unable to open trace");
+        return -1;
+    }
+
+    struct trace_file_header header;
+    if (fread(&header, sizeof(header), 1, trace) != 1
+            || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION){
+        fprintf(stderr, "%s is not a netfs trace\n", trace_path);
+        fclose(trace);
+        return -1;
+    }
+
+    size_t capacity = 0;
+    struct trace_record record;
+    while (fread(&record, sizeof(record), 1, trace) == 1){
+        if (record.request_type < REQ_READDIR || record.request_type > REQ_READ){
+            fprintf(stderr, "corrupt trace record %zu\n", op_count);
+            fclose(trace);
+            return -1;
+        }
+        if (op_count == capacity){
+            capacity = capacity == 0 ? 1024 : capacity * 2;
+            struct replay_op *grown = realloc(ops, capacity * sizeof(struct replay_op));
+            if (grown == NULL){
+                perror("realloc");
+                fclose(trace);
+                return -1;
+            }
+            ops = grown;
+        }
+
+        struct replay_op *op = &ops[op_count];
+        op->record = record;
+        op->path[0] = '\0';
+        int failed = record.path_len >= MAX_REQ
+            ? fseek(trace, record.path_len, SEEK_CUR) != 0
+            : record.path_len > 0 && fread(op->path, record.path_len, 1, trace) != 1;
+        if (failed){
+            fprintf(stderr, "truncated trace record %zu\n", op_count);
+            break;
+        }
+        if (record.path_len < MAX_REQ){
+            op->path[record.path_len] = '\0';
+        }
+        op_count++;
+    }
+    fclose(trace);
+
+    qsort(ops, op_count, sizeof(struct replay_op), compare_start);
+    return 0;
+}
+
+
+/**
+ * skip method
+ *
+ * reads and throws away part of a reply
+ *
+ * @param reader | the reader of the connection
+ *
+ * @param len | how many bytes to drop
+ *
+ * Envokes helper functions: reader_read
+ */
+static int reader_skip(struct frame_reader *reader, size_t len){
+    char scratch[4096];
+    while (len > 0){
+        size_t take = len < sizeof(scratch) ? len : sizeof(scratch);
+        if (reader_read(reader, scratch, take) == -1){
+            return -1;
+        }
+        len -= take;
+    }
+    return 0;
+}
+
+
+/**
+ * replay listing function
+ *
+ * reads readdir batches the way netfs_readdir does, asking for the next
+ * batch from the last cookie, until the directory ends or as many entries as
+ * the client offered fuse have gone by. The first reply header has been read.
+ *
+ * @param request | the readdir request, its offset is moved along the cookies
+ *
+ * @param socket_fd | the connection of the first batch
+ *
+ * @param reader | this thread's reply reader, left on the last connection
+ *
+ * @param wanted | entries the client offered fuse, 0 for the whole directory
+ *
+ * returns 0 or -EIO
+ *
+ * Envokes helper functions: reader_read, reader_skip, send_all
+ */
+static int32_t replay_listing(struct request_operations *request, int socket_fd,
+        struct frame_reader *reader, uint64_t wanted){
+    uint64_t seen = 0;
+    request->size = READDIR_BATCH;
+
+    while (true){
+        int32_t size;
+        int32_t at_end;
+        while (true){
+            if (reader_read(reader, &size, sizeof(size)) == -1 || size < 0 || size > NAME_MAX){
+                return -EIO;
+            }
+            if (size == 0){
+                break;
+            }
+            int64_t cookie;
+            if (reader_read(reader, &cookie, sizeof(cookie)) == -1 || reader_skip(reader, size) == -1){
+                return -EIO;
+            }
+            request->offset = cookie;
+            if (++seen == wanted){
+                return 0;
+            }
+        }
+        if (reader_read(reader, &at_end, sizeof(at_end)) == -1){
+            return -EIO;
+        }
+        if (at_end){
+            return 0;
+        }
+
+        //the next batch is a new request on a new connection, like the client sends it
+        shutdown(socket_fd, SHUT_RDWR);
+        close(socket_fd);
+        socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+        reader_reset(reader, socket_fd);
+        struct reply_header reply;
+        if (socket_fd == -1
+                || connect(socket_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1
+                || send_all(socket_fd, request, sizeof(*request)) == -1
+                || reader_read(reader, &reply, sizeof(reply)) == -1){
+            return -EIO;
+        }
+        if (reply.status != 0){
+            return reply.status;
+        }
+    }
+}
+
+
+/**
+ * replay request function
+ *
+ * sends one traced operation to the server and reads as much of the reply
+ * as the client did. Operations the client refuses without asking the server
+ * are refused here the same way.
+ *
+ * @param op | the request to replay
+ *
+ * @param reader | this thread's reply reader
+ *
+ * returns what the client would have handed to fuse
+ *
+ * Envokes helper functions: reader_read, reader_skip
+ */
+static int32_t replay_request(struct replay_op *op, struct frame_reader *reader){
+    if (op->record.path_len >= MAX_REQ){
+        return -ENAMETOOLONG;
+    }
+    if (op->record.request_type == REQ_OPEN && (op->record.size & O_ACCMODE) != O_RDONLY){
+        return -EACCES;
+    }
+
+    struct request_operations request = { 0 };
+    request.request_type = op->record.request_type;
+    request.size = op->record.request_type == REQ_READ ? op->record.size : 0;
+    request.offset = op->record.offset;
+    memcpy(request.request, op->path, op->record.path_len + 1);
+
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd == -1){
+        perror("socket");
+        return -EIO;
+    }
+    if (connect(socket_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1){
+        perror("connect");
+        close(socket_fd);
+        return -EIO;
+    }
+
+    int32_t result = -EIO;
+    struct reply_header reply;
+    reader_reset(reader, socket_fd);
+    if (send_all(socket_fd, &request, sizeof(request)) == -1
+            || reader_read(reader, &reply, sizeof(reply)) == -1){
+        goto done;
+    }
+    if (reply.status != 0){
+        result = reply.status;
+        goto done;
+    }
+
+    if (request.request_type == REQ_READDIR){
+        result = replay_listing(&request, socket_fd, reader, op->record.size);
+        socket_fd = reader->socket_fd;
+    } else if (reader_skip(reader, reply.length) == 0){
+        result = request.request_type == REQ_READ ? (int32_t) reply.length : 0;
+    }
+
+done:
+    shutdown(socket_fd, SHUT_RDWR);
+    close(socket_fd);
+    return result;
+}
+
+
+/**
+ * replay thread
+ *
+ * takes the next request off the trace, waits until it is due and replays it
+ *
+ * @param arg | unused
+ *
+ * Envokes helper functions: replay_request
+ */
+static void *replay_thread(void *arg){
+    struct frame_reader *reader = malloc(sizeof(struct frame_reader));
+    if (reader == NULL){
+        perror("malloc");
+        return NULL;
+    }
+
+    while (true){
+        pthread_mutex_lock(&op_lock);
+        size_t index = next_op++;
+        pthread_mutex_unlock(&op_lock);
+        if (index >= op_count){
+            break;
+        }
+        struct replay_op *op = &ops[index];
+
+        if (speed > 0){
+            uint64_t due = timespec_ns(&replay_epoch) + (uint64_t) (op->record.start_ns / speed);
+            struct timespec until = { due / 1000000000ull, due % 1000000000ull };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+        }
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        op->replay_status = replay_request(op, reader);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        op->replay_latency_ns = timespec_ns(&end) - timespec_ns(&start);
+    }
+
+    free(reader);
+    return NULL;
+}
+
+
+/**
+ * report function
+ *
+ * prints recorded and replayed latencies per request type
+ *
+ * @param elapsed | wall time the replay took in seconds
+ *
+ * Envokes helper functions: compare_latency
+ */
+static void print_report(double elapsed){
+    uint64_t *recorded = malloc(op_count * sizeof(uint64_t));
+    uint64_t *replayed = malloc(op_count * sizeof(uint64_t));
+    if (op_count > 0 && (recorded == NULL || replayed == NULL)){
+        perror("malloc");
+        free(recorded);
+        free(replayed);
+        return;
+    }
+
+    printf("replayed %zu requests in %.3fs (speed %g)\n", op_count, elapsed, speed);
+    printf("%-8s %8s %8s %10s %10s %10s %10s %10s %10s %10s\n", "op", "count", "mismatch",
+            "rec_p50", "rec_p99", "rec_mean", "rep_p50", "rep_p99", "rep_mean", "delta");
+
+    for (int type = REQ_READDIR; type <= REQ_READ; type++){
+        size_t count = 0;
+        size_t mismatch = 0;
+        double recorded_sum = 0;
+        double replayed_sum = 0;
+        for (size_t i = 0; i < op_count; i++){
+            if (ops[i].record.request_type != type){
+                continue;
+            }
+            recorded[count] = ops[i].record.latency_ns;
+            replayed[count] = ops[i].replay_latency_ns;
+            recorded_sum += recorded[count];
+            replayed_sum += replayed[count];
+            if (ops[i].record.status != ops[i].replay_status){
+                mismatch++;
+            }
+            count++;
+        }
+        if (count == 0){
+            continue;
+        }
+        qsort(recorded, count, sizeof(uint64_t), compare_latency);
+        qsort(replayed, count, sizeof(uint64_t), compare_latency);
+
+        //latencies are printed in microseconds
+        size_t p99 = (count * 99) / 100;
+        printf("%-8s %8zu %8zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %+10.1f\n",
+                request_names[type], count, mismatch,
+                recorded[count / 2] / 1e3, recorded[p99] / 1e3, recorded_sum / count / 1e3,
+                replayed[count / 2] / 1e3, replayed[p99] / 1e3, replayed_sum / count / 1e3,
+                (replayed_sum - recorded_sum) / count / 1e3);
+    }
+
+    free(recorded);
+    free(replayed);
+}
+
+
+/**
+ * records function
+ *
+ * prints every operation in start order with its recorded and replayed
+ * latency and result, for -v
+ *
+ * Does not envoke helper functions
+ */
+static void print_records(void){
+    printf("%12s %-8s %10s %10s %8s %8s %s\n", "start_ms", "op", "rec_us", "rep_us",
+            "rec_st", "rep_st", "path");
+    for (size_t i = 0; i < op_count; i++){
+        struct replay_op *op = &ops[i];
+        printf("%12.3f %-8s %10.1f %10.1f %8d %8d %s\n", op->record.start_ns / 1e6,
+                request_names[op->record.request_type], op->record.latency_ns / 1e3,
+                op->replay_latency_ns / 1e3, op->record.status, op->replay_status,
+                op->record.path_len >= MAX_REQ ? "(too long)" : op->path);
+    }
+}
+
+
+/**
+ * main function
+ *
+ * loads the trace, replays it with a pool of threads and prints the report
+ * (and every record with -v)
+ *
+ */
+int main(int argc, char *argv[]) {
+    int threads = DEFAULT_THREADS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:j:v")) != -1){
+        if (opt == 's'){
+            speed = atof(optarg);
+        } else if (opt == 'j'){
+            threads = atoi(optarg);
+        } else if (opt == 'v'){
+            verbose = true;
+        } else {
+            break;
+        }
+    }
+    if (argc - optind < 2 || argc - optind > 3 || threads < 1 || speed < 0){
+        fprintf(stderr, "usage: %s [-s speed] [-j threads] [-v] trace server [port]\n"
+                "    -s 1 replays at the recorded pace (default), 2 twice as fast,\n"
+                "    0 as fast as possible\n"
+                "    -v also prints recorded vs replayed latency of every record\n", argv[0]);
+        return 1;
+    }
+
+    int port = argc - optind == 3 ? atoi(argv[optind + 2]) : DEFAULT_PORT;
+    struct hostent *server_host = gethostbyname(argv[optind + 1]);
+    if (server_host == NULL){
+        fprintf(stderr, "Could not resolve host: %s\n", argv[optind + 1]);
+        return 1;
+    }
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr = *((struct in_addr *) server_host->h_addr);
+
+    if (load_trace(argv[optind]) == -1){
+        return 1;
+    }
+    LOG("Loaded %zu requests from %s\n", op_count, argv[optind]);
+
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    if (workers == NULL){
+        perror("malloc");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &replay_epoch);
+    for (int i = 0; i < threads; i++){
+        if (pthread_create(&workers[i], NULL, replay_thread, NULL) != 0){
+            perror("unable to create replay thread");
+            return 1;
+        }
+    }
+    for (int i = 0; i < threads; i++){
+        pthread_join(workers[i], NULL);
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    print_report((timespec_ns(&end) - timespec_ns(&replay_epoch)) / 1e9);
+    if (verbose){
+        print_records();
+    }
+
+    free(workers);
+    free(ops);
+    return 0;
+}
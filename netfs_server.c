@@ -4,48 +4,144 @@
  * NetFS file server implementation.
  */
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <sys/sendfile.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <netdb.h> 
+#include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 #include <dirent.h>
-#include <sys/wait.h>
 
+#include "alloc_count.h"
 #include "common.h"
 #include "logging.h"
-#define MAX_REQ 1024
+
+#define MAX_CLIENTS 64
+#define DEFAULT_WORKERS 4
+/* bulk bytes a weight-1 client may be served per scheduling round */
+#define QOS_QUANTUM (64 * 1024)
+/* reads larger than this are charged as this much when scheduling */
+#define QOS_MAX_COST (16 * 1024 * 1024)
+/* jobs are carved out of the heap this many at a time and never freed */
+#define JOB_SLAB 64
+/* once this many jobs are in flight new connections are turned away */
+#define MAX_JOBS 4096
+/* seconds a connection gets to send its whole request */
+#define REQUEST_TIMEOUT 5
+/* seconds a reply may wait for the client to take any of it before we give up */
+#define REPLY_TIMEOUT 5
+/* connections the accept loop watches per epoll_wait */
+#define MAX_EVENTS 64
+
 struct __attribute__((__packed__)) netfs_msg_header {
     uint64_t msg_len;
     uint16_t msg_type;
 };
 
-struct request_operations{
-    int request_type;
-    const char* request;
-}request_op;
-
-char client_request[MAX_REQ];
 char *directory;
 int port;
-pid_t p_id;
+
+/**
+ * request classes used by the scheduler, metadata is always served first
+ */
+enum request_class {
+    CLASS_META = 0,
+    CLASS_BULK = 1,
+    CLASS_COUNT
+};
+
+/**
+ * a request being read off a connection, then waiting for a worker.
+ * received counts how much of req has arrived so far.
+ */
+struct netfs_job {
+    int client_fd;
+    struct request_operations req;
+    size_t received;
+    char host[INET_ADDRSTRLEN];
+    struct timespec accepted_at;
+    struct qos_client *client;
+    enum request_class class;
+    uint64_t cost;
+    bool deferred;
+    struct netfs_job *next;
+};
+
+struct job_queue {
+    struct netfs_job *head;
+    struct netfs_job *tail;
+    int depth;
+};
+
+/**
+ * limits for one client host, rates of 0 mean unlimited
+ */
+struct qos_rule {
+    char host[INET_ADDRSTRLEN];
+    unsigned weight;
+    double ops_rate;
+    double bytes_rate;
+};
+
+/**
+ * scheduling state for one client host
+ */
+struct qos_client {
+    struct qos_rule rule;
+    double op_tokens;
+    double byte_tokens;
+    struct timespec last_refill;
+    struct job_queue queues[CLASS_COUNT];
+    uint64_t deficit;
+    int peak_depth[CLASS_COUNT];
+    uint64_t served[CLASS_COUNT];
+    uint64_t bytes_served;
+    uint64_t throttled;
+};
+
+struct qos_rule qos_rules[MAX_CLIENTS];
+int qos_rule_count;
+struct qos_rule qos_default = { "default", 1, 0, 0 };
+
+struct qos_client qos_clients[MAX_CLIENTS];
+int qos_client_count;
+int meta_cursor;
+int bulk_cursor;
+pthread_mutex_t qos_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t qos_ready;
+
+struct netfs_job *job_free_list;
+int jobs_allocated;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* connections whose request has not fully arrived, only touched by the accept loop */
+struct netfs_job *pending_list;
 
 
 /**
  * open file function
  *
  * this function is responsible for opening a file apon client request
+ * the reply carries the file's stat so the client can tell if its cached pages are still good
  *
  * @param client_path | this is the file path that the client is asking to open and read
  *
@@ -53,27 +149,41 @@ pid_t p_id;
  *
   * @param socket_fd | the socket we set up for connection
  *
+ * @param frame | the worker's reply buffer, at least REPLY_FRAME_MAX bytes
+ *
  * Does not envoke helper functions
  */
-int open_send(const char * client_path,char * server_path, int socket_fd){
-    int open_file; 
-    size_t write_size;
-    if ((strncmp(client_path,".",1) == 0 && strlen(client_path)== 1) || (strncmp(client_path,"./",2)==0 && strlen(client_path)>2)){
-        open_file=open(client_path, O_WRONLY | O_APPEND);
-        write_size= send(socket_fd,&open_file,sizeof(int),0); 
+int open_send(const char * client_path,char * server_path, int socket_fd, char *frame){
+    struct reply_header reply = { 0 };
+    struct stat status;
 
-        if (open_file == -1){
+    if ((strncmp(client_path,".",1) == 0 && strlen(client_path)== 1) || (strncmp(client_path,"./",2)==0 && strlen(client_path)>2)){
+        int open_file=open(client_path, O_RDONLY);
+        if (open_file == -1 || fstat(open_file,&status) != 0){
+            reply.status = -errno;
             perror("selected file could not be opened");
-            return 1;
         }
-    
-        if (write_size == -1){
-            perror("sending request failed");
-            return 1;
-        }  
-
+        if (open_file != -1){
+            close(open_file);
+        }
     } else{
+        reply.status = -ENOENT;
         perror("path to directory does not exist");
+    }
+
+    if (reply.status != 0){
+        send_all(socket_fd,&reply,sizeof(reply));
+        return 1;
+    }
+
+    // this makes file read only
+    status.st_mode = (mode_t) (~0222 & status.st_mode);
+
+    reply.length = sizeof(struct stat);
+    memcpy(frame, &reply, sizeof(reply));
+    memcpy(frame + sizeof(reply), &status, sizeof(struct stat));
+    if (send_all(socket_fd,frame,sizeof(reply) + sizeof(struct stat)) == -1){
+        perror("sending request failed");
         return 1;
     }
     return 0;
@@ -92,26 +202,39 @@ int open_send(const char * client_path,char * server_path, int socket_fd){
  *
   * @param socket_fd | the socket we set up for connection
  *
+ * @param frame | the worker's reply buffer, at least REPLY_FRAME_MAX bytes
+ *
  * Does not envoke helper functions
  */
-int getattr_send(const char * client_path,char * server_path, int socket_fd){
+int getattr_send(const char * client_path,char * server_path, int socket_fd, char *frame){
 
     struct stat status;
+    struct reply_header reply = { 0 };
 
     if ((strncmp(client_path,".",1) == 0 && strlen(client_path)== 1) || (strncmp(client_path,"./",2)==0 && strlen(client_path)>2)){
         if(stat(client_path,&status)!=0){
+            reply.status = -errno;
             perror("could not find file properties");
-            return 1;
         }
-        // this makes file read only
-        status.st_mode = (mode_t) (~0222 & status.st_mode);
+    } else {
+        reply.status = -ENOENT;
+    }
 
-        size_t write_size = send(socket_fd,&status,sizeof(struct stat),0);   
-        if (write_size == -1){
-            perror("sending request failed");
-            return 1;
-        }
+    if (reply.status != 0){
+        send_all(socket_fd,&reply,sizeof(reply));
+        return 1;
+    }
+
+    // this makes file read only
+    status.st_mode = (mode_t) (~0222 & status.st_mode);
 
+    //header and attributes go out in a single send
+    reply.length = sizeof(struct stat);
+    memcpy(frame, &reply, sizeof(reply));
+    memcpy(frame + sizeof(reply), &status, sizeof(struct stat));
+    if (send_all(socket_fd,frame,sizeof(reply) + sizeof(struct stat)) == -1){
+        perror("sending request failed");
+        return 1;
     }
 
     return 0;
@@ -128,78 +251,99 @@ int getattr_send(const char * client_path,char * server_path, int socket_fd){
  *
   * @param socket_fd | the socket we set up for connection
  *
+ * @param requested_size | how many bytes the client wants
+ *
+ * @param requested_offset | where in the file the read starts
+ *
+ * returns the number of bytes sent or -1
+ *
  * Does not envoke helper functions
  */
-int readfile_send(const char * client_path,char * server_path, int socket_fd){
-    if ((strncmp(client_path,".",1) == 0 && strlen(client_path)== 1) || (strncmp(client_path,"./",2)==0 && strlen(client_path)>2)){
-        
-        struct stat status;
-        size_t requested_size;
-        off_t requested_offset;
-        int open_file; 
-        int file_sent;
+ssize_t readfile_send(const char * client_path,char * server_path, int socket_fd,
+        size_t requested_size, off_t requested_offset){
+    struct reply_header reply = { 0 };
+    struct stat status;
+    int open_file = -1;
 
+    if ((strncmp(client_path,".",1) == 0 && strlen(client_path)== 1) || (strncmp(client_path,"./",2)==0 && strlen(client_path)>2)){
         //open selected file
-        open_file=open(client_path, O_WRONLY | O_APPEND);
-        if (open_file == -1){
+        open_file=open(client_path, O_RDONLY);
+        if (open_file == -1 || fstat(open_file,&status) != 0){
+            reply.status = -errno;
             perror("selected file could not be opened");
-            return 1;
+        } else if (!S_ISREG(status.st_mode)){
+            //sendfile can only stream regular files, say so before promising any data
+            reply.status = S_ISDIR(status.st_mode) ? -EISDIR : -EINVAL;
         }
+    } else {
+        reply.status = -ENOENT;
+    }
 
-        //recieve the file stat of the specified file
-        if(stat(client_path,&status)!=0){
-            perror("could not find file properties");
-            return 1;
+    if (reply.status == 0){
+        //clamp the read to what is actually left in the file
+        if (requested_offset < 0 || requested_offset >= status.st_size){
+            reply.length = 0;
+        } else if (requested_size > status.st_size - requested_offset){
+            reply.length = status.st_size - requested_offset;
+        } else {
+            reply.length = requested_size;
         }
+    }
 
-        // this makes file read only
-        status.st_mode = (mode_t) (~0222 & status.st_mode);
-
-        //recieve the size of read request from the client
-        size_t recieve_size=recv(socket_fd,&requested_size, sizeof(size_t),0);
-        if (recieve_size == -1){
-            perror("unable to recieve request");
-            return 1; 
-        }
-        //recieve the offset (read start) from the client
-        recieve_size=recv(socket_fd,&requested_offset, sizeof(off_t),0);
-        if (recieve_size == -1){
-            perror("unable to recieve request");
-            return 1; 
-        }
-        //if where we are reading from is out of file bounds
-        if (requested_offset>status.st_size){
-            requested_offset =0;
+    //MSG_MORE lets the header share a packet with the start of the file data
+    if (send(socket_fd,&reply,sizeof(reply),MSG_MORE | MSG_NOSIGNAL) != sizeof(reply)){
+        perror("unable to send file size");
+        if (open_file != -1){
+            close(open_file);
         }
-        if (requested_size> status.st_size){
-            requested_size=status.st_size-requested_offset;
+        return -1;
+    }
+    if (reply.status != 0){
+        if (open_file != -1){
+            close(open_file);
         }
-        //if the begining to the end of the file is out of bounds (we reset offset to be at the beginning)
-        if (requested_size-requested_offset >status.st_size ){
-            requested_offset=0;
+        return -1;
+    }
+
+    //send what we have read to the client. sendfile can wait out the send timeout
+    //several times in one call, so it runs non-blocking and we do the waiting
+    fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK);
+    struct pollfd writable = { socket_fd, POLLOUT, 0 };
+    size_t remaining = reply.length;
+    while (remaining > 0){
+        ssize_t file_sent= sendfile(socket_fd, open_file, &requested_offset, remaining);
+        if (file_sent == -1 && (errno == EAGAIN || errno == EINTR)){
+            int ready = poll(&writable, 1, REPLY_TIMEOUT * 1000);
+            if (ready == 0){
+                fprintf(stderr, "client stopped reading for %ds, dropping it\n", REPLY_TIMEOUT);
+                close(open_file);
+                return -1;
+            }
+            if (ready == -1 && errno != EINTR){
+                perror("could not wait for client");
+                close(open_file);
+                return -1;
+            }
+            continue;
         }
-        //send what we have read to the client
-        file_sent= sendfile(socket_fd, open_file, &requested_offset, requested_size);
-        if (file_sent == -1){
+        if (file_sent <= 0){
             perror("could not send file data");
-            return 1; 
-        }
-        //send the actual size of read preformed by the server
-        size_t write_size= send(socket_fd,&requested_size,sizeof(int),0); 
-
-        if (write_size == -1){
-            perror("unable to send file size");
-            return 1;
+            close(open_file);
+            return -1;
         }
-
+        remaining -= file_sent;
     }
-    return 0;
+
+    close(open_file);
+    return reply.length;
 }
 
 /**
  * read directory function
  *
  * this function is responsible for opening a directory on the server and reading its files and folders
+ * the listing is sent in batches: each name is sent as its length, the cookie that resumes after it
+ * and the name. A length of 0 ends the batch and is followed by 1 if the directory is exhausted.
  *
  * @param client_path | this is the directory path that the client is asking to open and read
  *
@@ -207,40 +351,767 @@ int readfile_send(const char * client_path,char * server_path, int socket_fd){
  *
   * @param socket_fd | the socket we set up for connection
  *
+ * @param cookie | where to resume, 0 for the start of the directory
+ *
+ * @param max_entries | how many entries the client wants in this batch
+ *
+ * @param frame | the worker's reply buffer, at least REPLY_FRAME_MAX bytes
+ *
  * Does not envoke helper functions
  */
-int readdir_send(const char * client_path,char * server_path, int socket_fd){
+int readdir_send(const char * client_path,char * server_path, int socket_fd,
+        off_t cookie, size_t max_entries, char *frame){
 
 
-    DIR *dir;
+    DIR *dir = NULL;
     struct dirent *file;
-    int size_path;
+    int32_t size_path;
+    int64_t next_cookie;
+    struct reply_header reply = { 0 };
 
 
     if ((strncmp(client_path,".",1) == 0 && strlen(client_path)== 1) || (strncmp(client_path,"./",2)==0 && strlen(client_path)>2)){
-        
+
         dir= opendir(client_path);
         if (dir == NULL){
+            reply.status = -errno;
             perror("directory not found");
-            return 1;
-        }
-        while((file=readdir(dir)) != NULL){
-            size_path= strlen(file->d_name);
-            size_t write_size_length = send(socket_fd,&size_path,sizeof(int),0);   
-            size_t write_size = send(socket_fd,&file->d_name,strlen(file->d_name)+1,0);   
-            if (write_size == -1 || write_size_length==-1){
-                perror("sending request failed");
-                return 1;
-            }
         }
-    } 
+    }
     else{
-    
+        reply.status = -ENOENT;
         perror("client path is not relative or absolute to server path");
+    }
+
+    if (reply.status != 0){
+        send_all(socket_fd,&reply,sizeof(reply));
         return 1;
     }
 
+    //the whole batch is built in the frame after room for the header and sent at once
+    size_t frame_len = sizeof(reply);
+
+    if (max_entries == 0 || max_entries > READDIR_MAX_BATCH){
+        max_entries = READDIR_MAX_BATCH;
+    }
+    if (cookie != 0){
+        seekdir(dir, cookie);
+    }
+
+    size_t sent = 0;
+    while(sent < max_entries && (file=readdir(dir)) != NULL){
+        size_path= strlen(file->d_name);
+        next_cookie= file->d_off;
+        memcpy(frame + frame_len, &size_path, sizeof(int32_t));
+        frame_len += sizeof(int32_t);
+        memcpy(frame + frame_len, &next_cookie, sizeof(int64_t));
+        frame_len += sizeof(int64_t);
+        memcpy(frame + frame_len, file->d_name, size_path);
+        frame_len += size_path;
+        sent++;
+    }
+
+    //only peek past the batch if it filled up, a short batch means we hit the end
+    int32_t at_end = sent < max_entries || readdir(dir) == NULL;
     closedir(dir);
+    size_path = 0;
+    memcpy(frame + frame_len, &size_path, sizeof(int32_t));
+    frame_len += sizeof(int32_t);
+    memcpy(frame + frame_len, &at_end, sizeof(int32_t));
+    frame_len += sizeof(int32_t);
+
+    //like every other reply the header carries the payload size, entries and trailer
+    reply.length = frame_len - sizeof(reply);
+    memcpy(frame, &reply, sizeof(reply));
+    if (send_all(socket_fd,frame,frame_len) == -1){
+        perror("sending request failed");
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * elapsed seconds helper
+ *
+ * @param from | the earlier time
+ *
+ * @param to | the later time
+ *
+ * Does not envoke helper functions
+ */
+static double elapsed_seconds(const struct timespec *from, const struct timespec *to){
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+
+/**
+ * client lookup function
+ *
+ * finds the scheduling state for a host, creating it from the matching rule
+ * the first time the host is seen. Must be called with qos_lock held.
+ *
+ * @param host | the remote address of the connection
+ *
+ * Does not envoke helper functions
+ */
+static struct qos_client *qos_lookup(const char *host){
+    for (int i = 0; i < qos_client_count; i++){
+        if (strcmp(qos_clients[i].rule.host, host) == 0){
+            return &qos_clients[i];
+        }
+    }
+    if (qos_client_count == MAX_CLIENTS){
+        //table is full, everyone else shares the last slot
+        return &qos_clients[MAX_CLIENTS - 1];
+    }
+
+    struct qos_client *client = &qos_clients[qos_client_count++];
+    client->rule = qos_default;
+    for (int i = 0; i < qos_rule_count; i++){
+        if (strcmp(qos_rules[i].host, host) == 0){
+            client->rule = qos_rules[i];
+            break;
+        }
+    }
+    strncpy(client->rule.host, host, INET_ADDRSTRLEN - 1);
+    client->op_tokens = client->rule.ops_rate;
+    client->byte_tokens = client->rule.bytes_rate;
+    clock_gettime(CLOCK_MONOTONIC, &client->last_refill);
+    return client;
+}
+
+
+/**
+ * token refill function
+ *
+ * tops up the ops and bandwidth buckets of a client, buckets hold at most one second of budget
+ *
+ * @param client | the client to refill
+ *
+ * @param now | the current monotonic time
+ *
+ * Does not envoke helper functions
+ */
+static void qos_refill(struct qos_client *client, const struct timespec *now){
+    double elapsed = elapsed_seconds(&client->last_refill, now);
+    client->last_refill = *now;
+
+    if (client->rule.ops_rate > 0){
+        double burst = client->rule.ops_rate < 1 ? 1 : client->rule.ops_rate;
+        client->op_tokens += elapsed * client->rule.ops_rate;
+        if (client->op_tokens > burst){
+            client->op_tokens = burst;
+        }
+    }
+    if (client->rule.bytes_rate > 0){
+        client->byte_tokens += elapsed * client->rule.bytes_rate;
+        if (client->byte_tokens > client->rule.bytes_rate){
+            client->byte_tokens = client->rule.bytes_rate;
+        }
+    }
+}
+
+
+/**
+ * eligibility check
+ *
+ * tells if a client is under its caps for the given class. When it is not,
+ * wait is lowered to the time until it will be.
+ *
+ * @param client | the client to check
+ *
+ * @param class | the request class we want to serve
+ *
+ * @param wait | the shortest time until a throttled client frees up
+ *
+ * Does not envoke helper functions
+ */
+static bool qos_eligible(struct qos_client *client, enum request_class class, double *wait){
+    double until = 0;
+
+    if (client->rule.ops_rate > 0 && client->op_tokens < 1){
+        until = (1 - client->op_tokens) / client->rule.ops_rate;
+    }
+    if (class == CLASS_BULK && client->rule.bytes_rate > 0 && client->byte_tokens <= 0){
+        double bytes_until = (1 - client->byte_tokens) / client->rule.bytes_rate;
+        if (bytes_until > until){
+            until = bytes_until;
+        }
+    }
+    if (until > 0 && (*wait < 0 || until < *wait)){
+        *wait = until;
+    }
+    return until == 0;
+}
+
+
+/**
+ * dequeue helper
+ *
+ * @param queue | the queue to pop the head of
+ *
+ * Does not envoke helper functions
+ */
+static struct netfs_job *queue_pop(struct job_queue *queue){
+    struct netfs_job *job = queue->head;
+    queue->head = job->next;
+    if (queue->head == NULL){
+        queue->tail = NULL;
+    }
+    queue->depth--;
+    return job;
+}
+
+
+/**
+ * defer helper
+ *
+ * counts the head job of a queue as throttled, once per job no matter how
+ * many times a worker finds it still over the caps
+ *
+ * @param client | the client that is over its caps
+ *
+ * @param class | the queue whose head has to wait
+ *
+ * Does not envoke helper functions
+ */
+static void qos_defer(struct qos_client *client, enum request_class class){
+    struct netfs_job *job = client->queues[class].head;
+    if (!job->deferred){
+        job->deferred = true;
+        client->throttled++;
+    }
+}
+
+
+/**
+ * scheduler pick function
+ *
+ * chooses the next job to run. Metadata requests go first, round robin
+ * between clients. Bulk reads are shared out with deficit round robin so
+ * each client gets bandwidth in proportion to its weight. Clients over
+ * their ops or bandwidth caps are skipped. Must be called with qos_lock held.
+ *
+ * @param meta_only | only metadata jobs may be picked
+ *
+ * @param wait | set to seconds until a throttled client frees up, or -1 if nothing is throttled
+ *
+ * Envokes helper functions: qos_refill, qos_eligible, qos_defer, queue_pop
+ */
+static struct netfs_job *qos_pick(bool meta_only, double *wait){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *wait = -1;
+
+    for (int i = 0; i < qos_client_count; i++){
+        qos_refill(&qos_clients[i], &now);
+    }
+
+    for (int i = 0; i < qos_client_count; i++){
+        int index = (meta_cursor + i) % qos_client_count;
+        struct qos_client *client = &qos_clients[index];
+        if (client->queues[CLASS_META].depth == 0){
+            continue;
+        }
+        if (!qos_eligible(client, CLASS_META, wait)){
+            qos_defer(client, CLASS_META);
+            continue;
+        }
+        meta_cursor = index + 1;
+        if (client->rule.ops_rate > 0){
+            client->op_tokens -= 1;
+        }
+        return queue_pop(&client->queues[CLASS_META]);
+    }
+
+    if (meta_only){
+        return NULL;
+    }
+
+    //find the eligible client that needs the fewest rounds of credit to afford its next read
+    struct qos_client *chosen = NULL;
+    uint64_t chosen_rounds = 0;
+    for (int i = 0; i < qos_client_count; i++){
+        int index = (bulk_cursor + i) % qos_client_count;
+        struct qos_client *client = &qos_clients[index];
+        if (client->queues[CLASS_BULK].depth == 0){
+            continue;
+        }
+        if (!qos_eligible(client, CLASS_BULK, wait)){
+            qos_defer(client, CLASS_BULK);
+            continue;
+        }
+        uint64_t cost = client->queues[CLASS_BULK].head->cost;
+        uint64_t quantum = (uint64_t) QOS_QUANTUM * client->rule.weight;
+        uint64_t rounds = 0;
+        if (cost > client->deficit){
+            rounds = (cost - client->deficit + quantum - 1) / quantum;
+        }
+        if (chosen == NULL || rounds < chosen_rounds){
+            chosen = client;
+            chosen_rounds = rounds;
+        }
+    }
+    if (chosen == NULL){
+        return NULL;
+    }
+
+    //hand out the credit every backlogged client would have earned in those rounds
+    for (int i = 0; i < qos_client_count && chosen_rounds > 0; i++){
+        struct qos_client *client = &qos_clients[i];
+        if (client->queues[CLASS_BULK].depth > 0){
+            client->deficit += chosen_rounds * QOS_QUANTUM * client->rule.weight;
+        }
+    }
+
+    struct netfs_job *job = queue_pop(&chosen->queues[CLASS_BULK]);
+    chosen->deficit -= job->cost;
+    if (chosen->queues[CLASS_BULK].depth == 0){
+        chosen->deficit = 0;
+    }
+    if (chosen->rule.ops_rate > 0){
+        chosen->op_tokens -= 1;
+    }
+    if (chosen->rule.bytes_rate > 0){
+        chosen->byte_tokens -= job->cost;
+    }
+    bulk_cursor = (chosen - qos_clients) + 1;
+    return job;
+}
+
+
+/**
+ * job get function
+ *
+ * takes a job off the free list, carving a new slab of jobs off the heap when
+ * the list is empty. Returns NULL once MAX_JOBS are in use, the accept loop
+ * must never block waiting for a worker.
+ *
+ * Does not envoke helper functions
+ */
+static struct netfs_job *job_get(void){
+    pthread_mutex_lock(&pool_lock);
+    if (job_free_list == NULL && jobs_allocated < MAX_JOBS){
+        struct netfs_job *slab = malloc(JOB_SLAB * sizeof(struct netfs_job));
+        if (slab == NULL){
+            perror("unable to grow job pool");
+        } else {
+            for (int i = 0; i < JOB_SLAB; i++){
+                slab[i].next = job_free_list;
+                job_free_list = &slab[i];
+            }
+            jobs_allocated += JOB_SLAB;
+        }
+    }
+    if (job_free_list == NULL){
+        pthread_mutex_unlock(&pool_lock);
+        return NULL;
+    }
+    struct netfs_job *job = job_free_list;
+    job_free_list = job->next;
+    pthread_mutex_unlock(&pool_lock);
+    return job;
+}
+
+
+/**
+ * job put function
+ *
+ * returns a finished job to the free list
+ *
+ * @param job | the job to recycle
+ *
+ * Does not envoke helper functions
+ */
+static void job_put(struct netfs_job *job){
+    pthread_mutex_lock(&pool_lock);
+    job->next = job_free_list;
+    job_free_list = job;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+
+/**
+ * enqueue function
+ *
+ * classifies a request and puts it on its client's queue, then wakes the workers
+ *
+ * @param job | the request read off a connection
+ *
+ * @param host | the remote address of the connection
+ *
+ * Envokes helper functions: qos_lookup
+ */
+static void qos_enqueue(struct netfs_job *job, const char *host){
+    if (job->req.request_type == REQ_READ){
+        job->class = CLASS_BULK;
+        job->cost = job->req.size > QOS_MAX_COST ? QOS_MAX_COST : job->req.size;
+    } else {
+        job->class = CLASS_META;
+        job->cost = 0;
+    }
+    job->deferred = false;
+    job->next = NULL;
+
+    pthread_mutex_lock(&qos_lock);
+    job->client = qos_lookup(host);
+    struct job_queue *queue = &job->client->queues[job->class];
+    if (queue->tail == NULL){
+        queue->head = job;
+    } else {
+        queue->tail->next = job;
+    }
+    queue->tail = job;
+    queue->depth++;
+    if (queue->depth > job->client->peak_depth[job->class]){
+        job->client->peak_depth[job->class] = queue->depth;
+    }
+    pthread_cond_broadcast(&qos_ready);
+    pthread_mutex_unlock(&qos_lock);
+}
+
+
+/**
+ * request dispatch function
+ *
+ * hands a request to the matching server handler
+ *
+ * @param req | the request sent by the client
+ *
+ * @param socket_fd | the connection to answer on
+ *
+ * @param frame | the worker's reply buffer
+ *
+ * returns the number of file bytes sent to the client
+ *
+ * Envokes helper functions: readdir_send, getattr_send, open_send, readfile_send
+ */
+static ssize_t handle_request(struct request_operations *req, int socket_fd, char *frame){
+    if (req->request_type == REQ_READDIR){
+        readdir_send(req->request, directory,socket_fd,req->offset,req->size,frame);
+    }
+    else if(req->request_type == REQ_GETATTR){
+        getattr_send(req->request, directory,socket_fd,frame);
+    }
+    else if(req->request_type == REQ_OPEN){
+        open_send(req->request, directory,socket_fd,frame);
+    }
+    else if(req->request_type == REQ_READ){
+        ssize_t sent = readfile_send(req->request,directory,socket_fd,req->size,req->offset);
+        return sent > 0 ? sent : 0;
+    }
+    return 0;
+}
+
+
+/**
+ * worker thread
+ *
+ * pulls jobs off the scheduler and runs them. Worker 0 only serves metadata
+ * so an `ls` never waits behind a batch of bulk reads. Each worker allocates
+ * its reply frame once and reuses it for every request.
+ *
+ * @param arg | non-zero if this worker only serves metadata
+ *
+ * Envokes helper functions: qos_pick, handle_request, job_put
+ */
+static void *worker_thread(void *arg){
+    bool meta_only = arg != NULL;
+    char *frame = malloc(REPLY_FRAME_MAX);
+    if (frame == NULL){
+        perror("unable to allocate reply frame");
+        return NULL;
+    }
+
+    while (true){
+        struct netfs_job *job;
+        double wait;
+
+        pthread_mutex_lock(&qos_lock);
+        while ((job = qos_pick(meta_only, &wait)) == NULL){
+            if (wait < 0){
+                pthread_cond_wait(&qos_ready, &qos_lock);
+            } else {
+                struct timespec until;
+                clock_gettime(CLOCK_MONOTONIC, &until);
+                until.tv_sec += (time_t) wait;
+                until.tv_nsec += (long) ((wait - (time_t) wait) * 1e9) + 1000000;
+                if (until.tv_nsec >= 1000000000){
+                    until.tv_sec++;
+                    until.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&qos_ready, &qos_lock, &until);
+            }
+        }
+        pthread_mutex_unlock(&qos_lock);
+
+        ssize_t sent = handle_request(&job->req, job->client_fd, frame);
+        close(job->client_fd);
+
+        pthread_mutex_lock(&qos_lock);
+        struct qos_client *client = job->client;
+        client->served[job->class]++;
+        client->bytes_served += sent;
+        if (client->rule.bytes_rate > 0 && (uint64_t) sent < job->cost){
+            //we charged for the full request, give back what was not read
+            client->byte_tokens += job->cost - sent;
+        }
+        pthread_mutex_unlock(&qos_lock);
+
+        job_put(job);
+    }
+    return NULL;
+}
+
+
+/**
+ * print stats function
+ *
+ * writes per-client queue depths and counters
+ *
+ * @param out | where the stats are written
+ *
+ * Does not envoke helper functions
+ */
+static void print_stats(FILE *out){
+    pthread_mutex_lock(&qos_lock);
+    fprintf(out, "%-16s %6s %8s %8s %8s %8s %10s %10s %12s %9s\n",
+            "client", "weight", "meta_q", "bulk_q", "meta_pk", "bulk_pk",
+            "meta_ops", "bulk_ops", "bytes", "throttled");
+    for (int i = 0; i < qos_client_count; i++){
+        struct qos_client *client = &qos_clients[i];
+        fprintf(out, "%-16s %6u %8d %8d %8d %8d %10lu %10lu %12lu %9lu\n",
+                client->rule.host, client->rule.weight,
+                client->queues[CLASS_META].depth, client->queues[CLASS_BULK].depth,
+                client->peak_depth[CLASS_META], client->peak_depth[CLASS_BULK],
+                client->served[CLASS_META], client->served[CLASS_BULK],
+                client->bytes_served, client->throttled);
+    }
+    pthread_mutex_unlock(&qos_lock);
+
+    pthread_mutex_lock(&pool_lock);
+    fprintf(out, "jobs pooled: %d, heap allocations: %lu\n",
+            jobs_allocated, heap_allocations());
+    pthread_mutex_unlock(&pool_lock);
+    fflush(out);
+}
+
+
+/**
+ * stats thread
+ *
+ * dumps the stats to stderr every time the server gets SIGUSR1
+ *
+ * @param arg | unused
+ *
+ * Envokes helper functions: print_stats
+ */
+static void *stats_thread(void *arg){
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    while (true){
+        int sig;
+        if (sigwait(&set, &sig) == 0){
+            print_stats(stderr);
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * pending removal helper
+ *
+ * unlinks a connection from the list of requests still arriving
+ *
+ * @param job | the connection to unlink
+ *
+ * Does not envoke helper functions
+ */
+static void pending_remove(struct netfs_job *job){
+    for (struct netfs_job **link = &pending_list; *link != NULL; link = &(*link)->next){
+        if (*link == job){
+            *link = job->next;
+            return;
+        }
+    }
+}
+
+
+/**
+ * drop connection helper
+ *
+ * gives up on a connection whose request never fully arrived
+ *
+ * @param job | the connection to drop
+ *
+ * Envokes helper functions: pending_remove, job_put
+ */
+static void drop_connection(struct netfs_job *job){
+    pending_remove(job);
+    close(job->client_fd);
+    job_put(job);
+}
+
+
+/**
+ * accept function
+ *
+ * accepts every waiting connection and starts watching it for its request
+ *
+ * @param socket_fd | the listening socket
+ *
+ * @param epoll_fd | the set the accept loop waits on
+ *
+ * Envokes helper functions: job_get
+ */
+static void accept_connections(int socket_fd, int epoll_fd){
+    while (true){
+        struct sockaddr_in client_addr = { 0 };
+        socklen_t slen = sizeof(client_addr);
+
+        int client_fd = accept4(
+                socket_fd,
+                (struct sockaddr *) &client_addr,
+                &slen,
+                SOCK_NONBLOCK);
+
+        if (client_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                perror("accept");
+            }
+            return;
+        }
+
+        struct netfs_job *job = job_get();
+        if (job == NULL){
+            LOG("Too many requests in flight, dropping connection %d\n", client_fd);
+            close(client_fd);
+            continue;
+        }
+        job->client_fd = client_fd;
+        job->received = 0;
+        clock_gettime(CLOCK_MONOTONIC, &job->accepted_at);
+        inet_ntop(
+                client_addr.sin_family,
+                (void *) &((&client_addr)->sin_addr),
+                job->host,
+                sizeof(job->host));
+        LOG("Accepted connection from %s:%d\n", job->host, client_addr.sin_port);
+
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = job };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1){
+            perror("epoll_ctl");
+            close(client_fd);
+            job_put(job);
+            continue;
+        }
+        job->next = pending_list;
+        pending_list = job;
+    }
+}
+
+
+/**
+ * request read function
+ *
+ * reads whatever part of the request has arrived without blocking. Once the
+ * whole frame is in, the connection leaves the epoll set, goes back to
+ * blocking mode for the worker and is handed to the scheduler. Sends get a
+ * timeout so a client that stops reading cannot hold a worker forever.
+ *
+ * @param job | the connection that became readable
+ *
+ * @param epoll_fd | the set the accept loop waits on
+ *
+ * Envokes helper functions: drop_connection, pending_remove, qos_enqueue
+ */
+static void read_request(struct netfs_job *job, int epoll_fd){
+    char *frame = (char *) &job->req;
+
+    while (job->received < sizeof(struct request_operations)){
+        ssize_t got = recv(job->client_fd, frame + job->received,
+                sizeof(struct request_operations) - job->received, 0);
+        if (got == -1 && errno == EINTR){
+            continue;
+        }
+        if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return;
+        }
+        if (got <= 0){
+            if (got == -1){
+                perror("unable to recieve request");
+            }
+            drop_connection(job);
+            return;
+        }
+        job->received += got;
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, job->client_fd, NULL);
+    int flags = fcntl(job->client_fd, F_GETFL);
+    fcntl(job->client_fd, F_SETFL, flags & ~O_NONBLOCK);
+    //a stalled send fails with EAGAIN and the worker drops the connection
+    struct timeval send_timeout = { REPLY_TIMEOUT, 0 };
+    setsockopt(job->client_fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+    pending_remove(job);
+
+    job->req.request[MAX_REQ - 1] = '\0';
+    qos_enqueue(job, job->host);
+}
+
+
+/**
+ * expire function
+ *
+ * drops connections that have not sent their whole request in REQUEST_TIMEOUT seconds
+ *
+ * Envokes helper functions: elapsed_seconds, drop_connection
+ */
+static void expire_requests(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    struct netfs_job *job = pending_list;
+    while (job != NULL){
+        struct netfs_job *next = job->next;
+        if (elapsed_seconds(&job->accepted_at, &now) >= REQUEST_TIMEOUT){
+            LOG("Request from %s timed out\n", job->host);
+            drop_connection(job);
+        }
+        job = next;
+    }
+}
+
+
+/**
+ * qos rule parser
+ *
+ * parses host,weight,ops_per_sec,bytes_per_sec; the host "default" sets the
+ * limits for clients without their own rule. Trailing fields may be left out.
+ *
+ * @param spec | the -c argument
+ *
+ * Does not envoke helper functions
+ */
+static int parse_rule(const char *spec){
+    struct qos_rule rule = { "", 1, 0, 0 };
+    char host[INET_ADDRSTRLEN];
+
+    int fields = sscanf(spec, "%15[^,],%u,%lf,%lf", host, &rule.weight, &rule.ops_rate, &rule.bytes_rate);
+    if (fields < 1 || rule.weight == 0){
+        return -1;
+    }
+    strcpy(rule.host, host);
+
+    if (strcmp(host, "default") == 0){
+        qos_default = rule;
+    } else if (qos_rule_count < MAX_CLIENTS){
+        qos_rules[qos_rule_count++] = rule;
+    }
     return 0;
 }
 
@@ -253,14 +1124,34 @@ int readdir_send(const char * client_path,char * server_path, int socket_fd){
  */
 int main(int argc, char *argv[]) {
 
-    if (argc == 3){
+    int workers = DEFAULT_WORKERS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:c:")) != -1){
+        if (opt == 't'){
+            workers = atoi(optarg);
+        } else if (opt == 'c'){
+            if (parse_rule(optarg) == -1){
+                fprintf(stderr, "invalid qos rule: %s\n", optarg);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "usage: %s [-t workers] [-c host,weight,ops/s,bytes/s] directory [port]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (workers < 2){
+        workers = 2;
+    }
+
+    if (argc - optind == 2){
 
-        directory = argv[1];
-        port=atoi(argv[2]);
+        directory = argv[optind];
+        port=atoi(argv[optind + 1]);
 
-    } 
-    else if (argc == 2){
-        directory = argv[1];
+    }
+    else if (argc - optind == 1){
+        directory = argv[optind];
         port=DEFAULT_PORT;
 
     } else{
@@ -268,7 +1159,7 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    //check path provided 
+    //check path provided
 
     if (chdir(directory) == -1){
         perror("path provided is invalid");
@@ -281,6 +1172,9 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    int reuse = 1;
+    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     struct sockaddr_in addr = { 0 };
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
@@ -290,71 +1184,70 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    if (listen(socket_fd, 10) == -1) {
+    if (listen(socket_fd, 128) == -1) {
         perror("listen");
         return 1;
     }
 
     LOG("Listening on port %d\n", port);
 
+    //clients may hang up mid reply (a hedged read that lost), sendfile must not kill us for it
+    signal(SIGPIPE, SIG_IGN);
 
-    while (true) {
-            /* Outer loop: this keeps accepting connection */
-            
-            //handling multiple processes
-            p_id = fork();
+    //only the stats thread takes SIGUSR1, every thread we start inherits this mask
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-            if (p_id == -1){
-                perror("unable to create a new process");
-                return 1;
-            } 
-            else if (p_id != 0){
-                int wait_stat;
-                waitpid(p_id, &wait_stat, 0);
-            }
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&qos_ready, &cond_attr);
 
-            struct sockaddr_in client_addr = { 0 };
-            socklen_t slen = sizeof(client_addr);
+    pthread_t thread;
+    pthread_create(&thread, NULL, stats_thread, NULL);
+    for (int i = 0; i < workers; i++){
+        if (pthread_create(&thread, NULL, worker_thread, i == 0 ? (void *) 1 : NULL) != 0){
+            perror("unable to create worker");
+            return 1;
+        }
+    }
 
-            int client_fd = accept(
-                    socket_fd,
-                    (struct sockaddr *) &client_addr,
-                    &slen);
 
-            if (client_fd == -1) {
-                perror("accept");
-                return 1;
-            }
+    //the accept loop only waits on sockets, so an idle client cannot hold up anyone else
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1 || fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK) == -1){
+        perror("epoll");
+        return 1;
+    }
+    struct epoll_event listen_event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &listen_event) == -1){
+        perror("epoll_ctl");
+        return 1;
+    }
 
-            char remote_host[INET_ADDRSTRLEN];
-            inet_ntop(
-                    client_addr.sin_family,
-                    (void *) &((&client_addr)->sin_addr),
-                    remote_host,
-                    sizeof(remote_host));
-            LOG("Accepted connection from %s:%d\n", remote_host, client_addr.sin_port);
+    struct epoll_event events[MAX_EVENTS];
+    while (true) {
+            /* Outer loop: this keeps accepting connections and reading their requests */
 
-            size_t recieve_size=recv(socket_fd,&request_op, sizeof(struct request_operations),0);
-            if (recieve_size == -1){
-                perror("unable to recieve request");
-                return 1; 
+            int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+            if (ready == -1 && errno != EINTR){
+                perror("epoll_wait");
+                return 1;
             }
 
-            if (request_op.request_type == 1){
-                readdir_send(request_op.request, directory,socket_fd);
-            } 
-            else if(request_op.request_type == 2){
-                getattr_send(request_op.request, directory,socket_fd);
-            } 
-            else if(request_op.request_type == 3){
-                open_send(request_op.request, directory,socket_fd);
-
-            }
-            else if(request_op.request_type == 4){
-                readfile_send(request_op.request,directory,socket_fd);
+            for (int i = 0; i < ready; i++){
+                if (events[i].data.ptr == NULL){
+                    accept_connections(socket_fd, epoll_fd);
+                } else {
+                    read_request(events[i].data.ptr, epoll_fd);
+                }
             }
+
+            expire_requests();
         }
 
-        return 0; 
+        return 0;
 
 }